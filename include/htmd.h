@@ -1,17 +1,310 @@
 #ifndef _HTMD_H
 #define _HTMD_H
 
-#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
 
-#define MAX_LINE_LEN 4096
+#define HTMD_VERSION_MAJOR 1
+#define HTMD_VERSION_MINOR 0
+#define HTMD_VERSION_PATCH 0
 
-#define eprintfn(msg, ...) do{fprintf(stderr, "[ERROR] " msg "\n", ##__VA_ARGS__);}while(0)
-
-#ifdef HTMD_CLI
-    char* render_markdown(char *input);
+// The libraries are built with hidden visibility, only what is marked here is exported.
+#if defined(__GNUC__) || defined(__clang__)
+    #define HTMD_API __attribute__((visibility("default")))
 #else
-    #include <emscripten/emscripten.h>
-    EMSCRIPTEN_KEEPALIVE char* render_markdown(char *input);
-#endif // HTMD_CLI
+    #define HTMD_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Allocator used for everything a render context allocates. Sizes are passed
+// back on realloc and free, so allocators don't have to track them.
+typedef struct{
+    void* (*alloc)(void *user, size_t size);
+    void* (*realloc)(void *user, void *ptr, size_t old_size, size_t new_size);
+    void (*free)(void *user, void *ptr, size_t size);
+    void *user;
+} Htmd_Allocator;
+
+// Counts the traffic going through `parent` (the C library when NULL).
+typedef struct{
+    const Htmd_Allocator *parent;
+    size_t allocations;      // successful alloc and realloc calls
+    size_t frees;
+    size_t bytes_requested;  // sum of the sizes asked for
+    size_t bytes_copied;     // bytes moved by a realloc that returned a new block
+    size_t bytes_in_use;
+    size_t high_water;       // largest bytes_in_use seen
+} Htmd_Alloc_Counter;
+
+HTMD_API Htmd_Allocator htmd_counting_allocator(Htmd_Alloc_Counter *counter);
+
+// Bump-pointer arena. Zero-initialize, optionally set `parent` and
+// `block_size`, and hand out htmd_arena_allocator(). htmd_arena_reset()
+// releases every allocation at once but keeps the blocks for reuse;
+// htmd_arena_release() returns them to the parent.
+typedef struct Htmd_Arena_Block Htmd_Arena_Block;
+
+typedef struct{
+    const Htmd_Allocator *parent; // NULL: the C library
+    size_t block_size;            // minimum block size, 0: 64 KiB
+    Htmd_Arena_Block *first;
+    Htmd_Arena_Block *current;
+    void *last;                   // most recent allocation, grows in place
+} Htmd_Arena;
+
+HTMD_API Htmd_Allocator htmd_arena_allocator(Htmd_Arena *arena);
+HTMD_API void htmd_arena_reset(Htmd_Arena *arena);
+HTMD_API void htmd_arena_release(Htmd_Arena *arena);
+
+// Keeps the HTML of blocks (runs of lines up to a blank line) from earlier
+// renders, so blocks that reappear in a new version of a document or in
+// another document aren't rendered again. Bounded by `max_bytes`. Used by
+// htmd_render() and htmd_render_cached() when set in the options; it must not
+// be used by two threads at once.
+typedef struct Htmd_Block_Cache Htmd_Block_Cache;
+
+HTMD_API Htmd_Block_Cache* htmd_block_cache_create(size_t max_bytes);
+HTMD_API void htmd_block_cache_destroy(Htmd_Block_Cache *cache);
+
+// Called with every piece of rendered HTML, in order.
+typedef void (*Htmd_Write_Fn)(void *user, const char *data, size_t size);
+
+// Rewrites the target of a link or image on `line` (counted from 1) of the
+// document. Returns the target to use, which only has to stay valid until the
+// next call, or NULL to keep `target`. Not called for blocks taken from a
+// block cache.
+typedef const char* (*Htmd_Link_Fn)(void *user, const char *target, size_t size, size_t line, size_t *new_size);
+
+// Called with every heading: its level (1-6), its id (NULL without
+// Htmd_Options.heading_ids) and its text without the markup. Blocks with
+// headings aren't put into a block cache while this is set, and as the keys
+// of contexts with and without it differ, they aren't taken from one either.
+typedef void (*Htmd_Heading_Fn)(void *user, size_t level, const char *id, size_t id_size, const char *text, size_t text_size);
+
+// Called with the text of the document as it is rendered, without markup:
+// the runs between the markup of paragraphs, headings, list items and quotes,
+// link texts and image descriptions. "\n" follows the text of every line.
+// Code blocks are left out. No block cache is used while this is set.
+typedef void (*Htmd_Text_Fn)(void *user, const char *text, size_t size);
+
+typedef enum{
+    Htmd_Format_Html,
+    // The text alone, for indexing, summaries and word counts: tags are left
+    // out, every line of a paragraph, heading, list item or quote ends in
+    // "\n" and paragraphs are kept apart by an empty line. Links and images
+    // become their text, numeric entities and &amp; &lt; &gt; &quot; &apos;
+    // &nbsp; the characters they stand for (as UTF-8).
+    Htmd_Format_Text,
+} Htmd_Format;
+
+typedef struct{
+    Htmd_Write_Fn write; // when NULL the output is kept and can be read with htmd_output()
+    void *user;
+    bool collect_stats;  // measure the time spent in block parsing and inline rendering
+    const Htmd_Allocator *allocator; // NULL: malloc/realloc/free
+    Htmd_Arena *arena;   // per render memory; NULL: an arena owned by the context, reset by htmd_begin()
+    Htmd_Block_Cache *block_cache;
+    // The block cache and Htmd_Cache go by the markdown together with the
+    // options that change the output: the format and its text options, the
+    // heading options and the link function with its user pointer. Contexts
+    // with different options can share them. htmd_render_cached() renders
+    // without its cache while a link, heading or text function or toc_apart
+    // is set, as a hit would skip them.
+    Htmd_Link_Fn link;
+    void *link_user;
+    // Headings get an id made from their text ("Getting started" ->
+    // id="getting-started"), unique in the document.
+    bool heading_ids;
+    // Puts a table of contents (<nav class="toc">) of the headings in place
+    // of a "[TOC]" line, or at the top when there is none. Implies
+    // heading_ids. The output is held back until the document is done.
+    bool toc;
+    // Only builds the table of contents, for htmd_toc(), e.g. to put it
+    // elsewhere in a page. Implies heading_ids.
+    bool toc_apart;
+    Htmd_Heading_Fn heading;
+    void *heading_user;
+    Htmd_Text_Fn text;
+    void *text_user;
+    Htmd_Format format;
+    // Htmd_Format_Text: links are followed by their target in parentheses
+    bool text_link_urls;
+    // Htmd_Format_Text: code spans and blocks are kept, without the markup
+    bool text_code;
+} Htmd_Options;
+
+// Counters of the last render, see htmd_stats().
+typedef struct{
+    size_t input_bytes;
+    size_t output_bytes;
+    size_t lines;
+
+    // blocks
+    size_t headings;
+    size_t paragraphs;
+    size_t lists;
+    size_t code_blocks;
+    size_t blockquotes;
+    size_t rules;
+
+    // inline elements
+    size_t strong;
+    size_t emphasis;
+    size_t code_spans;
+    size_t strikethroughs;
+    size_t links;
+    size_t images;
+    size_t checkboxes;
+
+    // only measured with Htmd_Options.collect_stats
+    uint64_t block_nanos;
+    uint64_t inline_nanos;
+
+    size_t peak_output_size; // most bytes the output buffer held at once, i.e. before being written
+
+    // blocks taken from and missing in Htmd_Options.block_cache
+    size_t block_cache_hits;
+    size_t block_cache_misses;
+
+    // an allocation failed; the render stopped appending and its output is incomplete
+    bool out_of_memory;
+} Htmd_Stats;
+
+// Thread safety: every function here may be called from any number of threads
+// at once as long as each thread uses its own Htmd_Context (and arena). The
+// library has no hidden global state.
+
+// Push parser for input that arrives in chunks:
+//   htmd_begin(ctx); htmd_feed(ctx, buf, len)...; htmd_finish(ctx);
+// Blocks and lines may span chunk boundaries. The HTML of every completed line
+// is handed to the writer before htmd_feed() returns.
+typedef struct Htmd_Context Htmd_Context;
+
+HTMD_API Htmd_Context* htmd_create(const Htmd_Options *options);
+HTMD_API void htmd_destroy(Htmd_Context *ctx);
+HTMD_API void htmd_begin(Htmd_Context *ctx);
+HTMD_API void htmd_feed(Htmd_Context *ctx, const char *buf, size_t len);
+// false when the render ran out of memory, see Htmd_Stats.out_of_memory
+HTMD_API bool htmd_finish(Htmd_Context *ctx);
+HTMD_API const char* htmd_output(Htmd_Context *ctx, size_t *size);
+
+// Output made of segments that reference the input and static tag strings
+// instead of copying them.
+typedef struct{
+    const char *data;
+    size_t size;
+} Htmd_Segment;
+
+typedef struct{
+    const Htmd_Segment *items;
+    size_t count;
+    size_t size; // total number of bytes
+} Htmd_Rope;
+
+// Renders a whole document into a rope. The segments stay valid until the
+// next render with the same context and only as long as `input` does. The
+// rope is empty when the render ran out of memory.
+HTMD_API Htmd_Rope htmd_render_rope(Htmd_Context *ctx, const char *input, size_t len);
+
+// Renders a whole document. Without a writer the returned HTML stays valid
+// until the next render with the same context. NULL when it ran out of memory.
+HTMD_API const char* htmd_render(Htmd_Context *ctx, const char *input, size_t len, size_t *size);
+HTMD_API const Htmd_Stats* htmd_stats(Htmd_Context *ctx);
+
+// A "key: value" line of the front matter, metadata at the start of a
+// document between two "---" lines, which isn't rendered:
+//   ---
+//   title: Getting started
+//   description: "What to install first"
+//   ---
+// Quotes around a value are taken off. Lines are only front matter once the
+// closing "---" (or "...") is there; a blank line or any other line before it
+// and they are rendered as markdown. Both point into the input when the
+// render had all of it (everything but htmd_feed()), else into memory of the
+// context, and stay valid until the next render.
+typedef struct{
+    const char *key;
+    size_t key_size;
+    const char *value;
+    size_t value_size;
+} Htmd_Meta;
+
+// The table of contents of the last render with Htmd_Options.toc_apart,
+// empty without headings. Valid until the next render.
+HTMD_API const char* htmd_toc(Htmd_Context *ctx, size_t *size);
+
+// The front matter of the last render, in the order of the document.
+HTMD_API const Htmd_Meta* htmd_front_matter(Htmd_Context *ctx, size_t *count);
+// The value of `key` in it, NULL when it isn't there.
+HTMD_API const char* htmd_meta(Htmd_Context *ctx, const char *key, size_t *size);
+
+// snprintf-style rendering for callers that manage their own memory: writes
+// the HTML (not NUL-terminated) to `out` and returns its size. If that is
+// more than `out_cap` the content of `out` is unusable, and the caller can
+// retry with a buffer of the returned size. Both render the document once and
+// neither allocates; htmd_measure() only computes the size.
+HTMD_API size_t htmd_measure(const char *input, size_t len);
+HTMD_API size_t htmd_render_into(const char *input, size_t len, char *out, size_t out_cap);
+
+// 128 bit hash of `size` bytes. Fast, but not cryptographic.
+typedef struct{
+    uint64_t lo;
+    uint64_t hi;
+} Htmd_Hash;
+
+HTMD_API Htmd_Hash htmd_hash(const void *data, size_t size);
+
+// Cache of rendered documents keyed by the hash of their markdown and options
+// (see Htmd_Options.block_cache), for hosts that render the same documents
+// over and over. One cache can be shared by any number of threads. It keeps
+// at most `max_bytes` (HTML plus bookkeeping) and evicts the documents that
+// weren't used recently; a document bigger than a sixteenth of that is never
+// cached. Not in the WASM build.
+typedef struct Htmd_Cache Htmd_Cache;
+
+typedef struct{
+    size_t hits;
+    size_t misses;
+    size_t insertions;
+    size_t evictions;
+    size_t entries;
+    size_t bytes;
+} Htmd_Cache_Stats;
+
+HTMD_API Htmd_Cache* htmd_cache_create(size_t max_bytes);
+HTMD_API void htmd_cache_destroy(Htmd_Cache *cache);
+// Same as htmd_render(), but a document that is in the cache is copied from
+// there instead of being rendered; only the byte counts of its stats are set.
+HTMD_API const char* htmd_render_cached(Htmd_Cache *cache, Htmd_Context *ctx, const char *input, size_t len, size_t *size);
+HTMD_API Htmd_Cache_Stats htmd_cache_stats(Htmd_Cache *cache);
+
+// The built-in link rewrite for rendering a tree of documents: relative links
+// to markdown files point at the HTML they become, "../guide/setup.md#build"
+// turns into "../guide/setup.html#build". Targets are resolved against the
+// directory of the current document and memoized (at most `max_bytes`),
+// since the same few are linked over and over. Use it as
+//   options.link = htmd_links_rewrite; options.link_user = links;
+// and call htmd_links_set_document() before every render. Not thread-safe,
+// not in the WASM build.
+typedef struct Htmd_Links Htmd_Links;
+
+HTMD_API Htmd_Links* htmd_links_create(size_t max_bytes);
+HTMD_API void htmd_links_destroy(Htmd_Links *links);
+HTMD_API void htmd_links_set_document(Htmd_Links *links, const char *path);
+// whether `target` is a relative path: no scheme ("https:"), not absolute,
+// not only a fragment ("#usage")
+HTMD_API bool htmd_link_is_relative(const char *target, size_t size);
+HTMD_API const char* htmd_links_rewrite(void *links, const char *target, size_t size, size_t line, size_t *new_size);
+
+// Renders a NUL-terminated document into a malloc()ed, NUL-terminated string.
+HTMD_API char* render_markdown(char *input);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif // _HTMD_H
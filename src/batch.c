@@ -0,0 +1,1048 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+
+#include <htmd.h>
+#include "batch.h"
+#include "uring.h"
+#include "output.h"
+#include <cwalk.h>
+
+typedef struct Job{
+    struct Job *next;
+    char *input;
+    char *output;
+    // io_uring only
+    int pending;          // completions the current stage still waits for
+    int error;            // negative errno of the first failed operation
+    const char *failed;   // what failed
+    unsigned buffer;      // registered read buffer, also the direct descriptor of the read
+    unsigned slot;        // direct descriptor of the write
+    size_t input_size;
+    bool truncated;       // didn't fit into its read buffer
+    bool written;         // by the render thread, with if_changed
+    char *html;
+    size_t html_size;
+    struct iovec iov[3];
+} Job;
+
+typedef struct{
+    Job *head;
+    Job *tail;
+} Job_List;
+
+void job_push(Job_List *list, Job *job)
+{
+    job->next = NULL;
+    if (list->tail != NULL) list->tail->next = job;
+    else list->head = job;
+    list->tail = job;
+}
+
+Job* job_pop(Job_List *list)
+{
+    Job *job = list->head;
+    if (job == NULL) return NULL;
+    list->head = job->next;
+    if (list->head == NULL) list->tail = NULL;
+    return job;
+}
+
+void job_free(Job *job)
+{
+    free(job->html);
+    free(job);
+}
+
+// I/O through io_uring: URING_BUFFERS reads of up to URING_BUFFER_SIZE bytes
+// into registered buffers and as many writes are in flight at a time. Every
+// file goes through two chains of linked operations using direct
+// descriptors, so no file descriptor is ever returned to user space:
+//   openat -> read_fixed -> close   and   openat -> writev -> close
+#define URING_ENTRIES 512
+#define URING_BUFFERS 64
+#define URING_BUFFER_SIZE (64*1024)
+#define URING_SLOTS (2*URING_BUFFERS)
+
+// memoized link targets per render thread
+#define BATCH_LINKS_MEMORY (1024*1024)
+
+typedef enum{
+    Op_Event,
+    Op_Open_Input,
+    Op_Read,
+    Op_Close_Input,
+    Op_Open_Output,
+    Op_Write,
+    Op_Close_Output,
+} Op;
+
+struct Batch{
+    Batch_Options options;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // render threads wait for work here
+    Job_List pending;           // added, not started yet
+    Job_List ready;             // read, waiting for a render thread (io_uring)
+    Job_List rendered;          // waiting to be written (io_uring)
+    bool closed;                // batch_finish() was called
+    bool io_done;               // the io_uring thread is gone, render threads can stop
+    pthread_t *threads;
+    size_t thread_count;
+    Batch_Report report;        // merged under the lock
+
+    bool uring;
+    pthread_t io_thread;
+    Uring ring;
+    char *buffers;
+    int event_fd;               // wakes the io_uring thread
+    atomic_bool io_sleeping;
+    atomic_size_t wakeups;
+};
+
+void report_failure(const char *what, const char *path, int error)
+{
+    fprintf(stderr, "[ERROR] Could not %s '%s': %s\n", what, path, strerror(error));
+}
+
+void report_merge(Batch *batch, const Batch_Report *report)
+{
+    pthread_mutex_lock(&batch->lock);
+    batch->report.files += report->files;
+    batch->report.unchanged += report->unchanged;
+    batch->report.failed += report->failed;
+    batch->report.input_bytes += report->input_bytes;
+    batch->report.output_bytes += report->output_bytes;
+    batch->report.syscalls += report->syscalls;
+    pthread_mutex_unlock(&batch->lock);
+}
+
+// Blocking I/O
+
+// reads a whole file with open, fstat, read and close
+char* read_input(const char *path, size_t *size, Batch_Report *report)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    report->syscalls += 1;
+    if (fd < 0){
+        report_failure("open", path, errno);
+        return NULL;
+    }
+    struct stat st;
+    report->syscalls += 1;
+    char *data = NULL;
+    if (fstat(fd, &st) < 0){
+        report_failure("stat", path, errno);
+        goto done;
+    }
+    data = malloc(st.st_size + 1);
+    if (data == NULL){
+        report_failure("read", path, ENOMEM);
+        goto done;
+    }
+    size_t n = 0;
+    while (n < (size_t) st.st_size){
+        ssize_t r = read(fd, data + n, st.st_size - n);
+        report->syscalls += 1;
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        n += r;
+    }
+    if (n < (size_t) st.st_size){
+        report_failure("read", path, errno);
+        free(data);
+        data = NULL;
+        goto done;
+    }
+    *size = n;
+  done:
+    close(fd);
+    report->syscalls += 1;
+    return data;
+}
+
+// writes the `total` bytes of `iov`, the pieces of a page
+bool write_output(Batch *batch, const char *path, const struct iovec *iov, size_t n, size_t total, Batch_Report *report)
+{
+    if (batch->options.if_changed){
+        switch (write_if_changed(path, iov, n, 0644, &report->syscalls)){
+            case Write_Failed: return false;
+            case Write_Unchanged: report->unchanged += 1; break;
+            case Write_Done: report->output_bytes += total; break;
+        }
+        return true;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    report->syscalls += 1;
+    if (fd < 0){
+        report_failure("create", path, errno);
+        return false;
+    }
+    bool ok = writev_copy(fd, iov, n);
+    report->syscalls += 1;
+    if (!ok) report_failure("write", path, errno);
+    else report->output_bytes += total;
+    close(fd);
+    report->syscalls += 1;
+    return ok;
+}
+
+// Links and pages
+
+void strings_append(Batch_Strings *strings, const char *data, size_t size)
+{
+    if (strings->count + size > strings->capacity){
+        size_t capacity = strings->capacity == 0 ? 4096 : 2*strings->capacity;
+        while (capacity < strings->count + size) capacity *= 2;
+        strings->items = realloc(strings->items, capacity);
+        assert(strings->items != NULL && "Buy more RAM");
+        strings->capacity = capacity;
+    }
+    memcpy(strings->items + strings->count, data, size);
+    strings->count += size;
+}
+
+// returns the offset of the string
+size_t strings_push(Batch_Strings *strings, const char *data, size_t size)
+{
+    size_t offset = strings->count;
+    strings_append(strings, data, size);
+    strings_append(strings, "", 1);
+    return offset;
+}
+
+void links_push(Batch_Links *links, Batch_Link link)
+{
+    if (links->count == links->capacity){
+        links->capacity = links->capacity == 0 ? 256 : 2*links->capacity;
+        links->items = realloc(links->items, links->capacity*sizeof(*links->items));
+        assert(links->items != NULL && "Buy more RAM");
+    }
+    links->items[links->count++] = link;
+}
+
+void links_push_anchor(Batch_Links *links, Htmd_Hash anchor)
+{
+    if (links->anchor_count == links->anchor_capacity){
+        links->anchor_capacity = links->anchor_capacity == 0 ? 256 : 2*links->anchor_capacity;
+        links->anchors = realloc(links->anchors, links->anchor_capacity*sizeof(*links->anchors));
+        assert(links->anchors != NULL && "Buy more RAM");
+    }
+    links->anchors[links->anchor_count++] = anchor;
+}
+
+void links_merge(Batch_Links *links, const Batch_Links *other)
+{
+    for (size_t i = 0; i < other->anchor_count; ++i) links_push_anchor(links, other->anchors[i]);
+    if (other->count == 0) return;
+    size_t base = links->strings.count;
+    strings_append(&links->strings, other->strings.items, other->strings.count);
+    for (size_t i = 0; i < other->count; ++i){
+        Batch_Link link = other->items[i];
+        link.source += base;
+        link.target += base;
+        link.original += base;
+        links_push(links, link);
+    }
+}
+
+void batch_links_free(Batch_Links *links)
+{
+    free(links->items);
+    free(links->strings.items);
+    free(links->anchors);
+    *links = (Batch_Links) {0};
+}
+
+void pages_push(Batch_Pages *pages, Batch_Page page)
+{
+    if (pages->count == pages->capacity){
+        pages->capacity = pages->capacity == 0 ? 64 : 2*pages->capacity;
+        pages->items = realloc(pages->items, pages->capacity*sizeof(*pages->items));
+        assert(pages->items != NULL && "Buy more RAM");
+    }
+    pages->items[pages->count++] = page;
+}
+
+void pages_merge(Batch_Pages *pages, const Batch_Pages *other)
+{
+    if (other->count == 0) return;
+    size_t base = pages->strings.count;
+    strings_append(&pages->strings, other->strings.items, other->strings.count);
+    for (size_t i = 0; i < other->count; ++i){
+        Batch_Page page = other->items[i];
+        page.output += base;
+        page.title += base;
+        page.text += base;
+        pages_push(pages, page);
+    }
+}
+
+void batch_pages_free(Batch_Pages *pages)
+{
+    free(pages->items);
+    free(pages->strings.items);
+    *pages = (Batch_Pages) {0};
+}
+
+// what every render thread has for itself
+typedef struct{
+    Batch *batch;
+    Htmd_Context *ctx;
+    Htmd_Links *links;
+    // links and pages are collected per thread and merged when it's done
+    Batch_Links collected;
+    Batch_Pages pages;
+    Search_Builder *search;
+    Batch_Page page;              // of the job, its text goes straight into `pages`
+    char title[256];
+    size_t title_size;
+    bool titled;
+    bool titles;                  // the title is needed, for the pages or the template
+    char title_html[6*256];       // the title escaped, for the template
+    struct iovec *iov;            // the pieces of the page, see renderer_page()
+    const Job *job;
+    size_t source;                // of the job in `collected`, SIZE_MAX until its first link
+    char out_dir[FILENAME_MAX];   // of the job's output
+    char output[FILENAME_MAX];    // the job's output, normalized
+    char anchor[FILENAME_MAX];    // the same, the ids of its headings are put after it
+    char path[FILENAME_MAX];
+} Renderer;
+
+// hash of "<path>#<fragment>", zero when it doesn't fit into `buffer`
+Htmd_Hash anchor_hash(char *buffer, size_t capacity, size_t path_len, const char *fragment, size_t fragment_size)
+{
+    if (path_len + 1 + fragment_size > capacity) return (Htmd_Hash) {0};
+    buffer[path_len] = '#';
+    memcpy(buffer + path_len + 1, fragment, fragment_size);
+    return htmd_hash(buffer, path_len + 1 + fragment_size);
+}
+
+// records the link to `target`, which was `original` in the document
+void record_link(Renderer *renderer, const char *target, size_t size, const char *original, size_t original_size, size_t line)
+{
+    // "#usage" leads to the document itself
+    bool here = size > 0 && target[0] == '#';
+    if (!here && !htmd_link_is_relative(target, size)) return;
+    size_t path_len = 0;
+    while (path_len < size && target[path_len] != '#' && target[path_len] != '?') path_len += 1;
+    if (path_len >= sizeof(renderer->path)) return;
+    char resolved[FILENAME_MAX];
+    size_t resolved_len;
+    if (here){
+        resolved_len = strlen(renderer->output);
+        memcpy(resolved, renderer->output, resolved_len);
+    }else{
+        memcpy(renderer->path, target, path_len);
+        renderer->path[path_len] = '\0';
+        resolved_len = cwk_path_join(renderer->out_dir, renderer->path, resolved, sizeof(resolved));
+        if (resolved_len >= sizeof(resolved)) return;
+    }
+
+    // only the headings of pages are known
+    Htmd_Hash anchor = {0};
+    const char *fragment = memchr(target, '#', size);
+    bool page = resolved_len > 5 && memcmp(resolved + resolved_len - 5, ".html", 5) == 0;
+    Batch_Options *options = &renderer->batch->options;
+    bool ids = options->heading_ids || options->toc || (options->template != NULL && options->template->has[Template_Toc]);
+    if (ids && fragment != NULL && fragment + 1 < target + size && page){
+        fragment += 1;
+        anchor = anchor_hash(resolved, sizeof(resolved), resolved_len, fragment, target + size - fragment);
+    }
+
+    Batch_Links *links = &renderer->collected;
+    if (renderer->source == SIZE_MAX) renderer->source = strings_push(&links->strings, renderer->job->input, strlen(renderer->job->input));
+    size_t target_offset = strings_push(&links->strings, target, size);
+    links_push(links, (Batch_Link) {
+        .source = renderer->source,
+        .target = target_offset,
+        .original = target == original ? target_offset : strings_push(&links->strings, original, original_size),
+        .line = line,
+        .resolved = htmd_hash(resolved, resolved_len),
+        .anchor = anchor,
+    });
+}
+
+void renderer_set_title(Renderer *renderer, const char *text, size_t size)
+{
+    if (size >= sizeof(renderer->title)){
+        // cut before a UTF-8 continuation byte
+        size = sizeof(renderer->title) - 1;
+        while (size > 0 && (text[size] & 0xC0) == 0x80) size -= 1;
+    }
+    memcpy(renderer->title, text, size);
+    renderer->title_size = size;
+    renderer->titled = true;
+}
+
+void renderer_heading(void *user, size_t level, const char *id, size_t id_size, const char *text, size_t text_size)
+{
+    (void) level;
+    Renderer *renderer = user;
+    Batch_Options *options = &renderer->batch->options;
+    if (renderer->titles && !renderer->titled) renderer_set_title(renderer, text, text_size);
+    if (options->links != NULL && id != NULL){
+        Htmd_Hash anchor = anchor_hash(renderer->anchor, sizeof(renderer->anchor), strlen(renderer->output), id, id_size);
+        if (anchor.lo != 0 || anchor.hi != 0) links_push_anchor(&renderer->collected, anchor);
+    }
+}
+
+void renderer_text(void *user, const char *text, size_t size)
+{
+    Renderer *renderer = user;
+    if (renderer->search != NULL) search_text(renderer->search, text, size);
+    if (renderer->batch->options.pages == NULL) return;
+    Batch_Strings *strings = &renderer->pages.strings;
+    if (size == 1 && text[0] == '\n'){
+        bool empty = strings->count == renderer->page.text;
+        if (!empty && strings->items[strings->count-1] != ' ') strings_append(strings, " ", 1);
+        return;
+    }
+    strings_append(strings, text, size);
+}
+
+void page_begin(Renderer *renderer, const Job *job, Batch_Report *report)
+{
+    struct stat st;
+    report->syscalls += 1;
+    renderer->page = (Batch_Page) {
+        .output = strings_push(&renderer->pages.strings, job->output, strlen(job->output)),
+        .mtime = stat(job->input, &st) == 0 ? (int64_t) st.st_mtime : 0,
+    };
+    renderer->page.text = renderer->pages.strings.count;
+}
+
+// "2024-05-17", optionally followed by a time "12:30[:00]", in UTC
+bool parse_date(const char *text, size_t size, int64_t *seconds)
+{
+    char buffer[64];
+    if (size >= sizeof(buffer)) return false;
+    memcpy(buffer, text, size);
+    buffer[size] = '\0';
+    struct tm tm = {0};
+    int n = sscanf(buffer, "%d-%d-%d%*[ T]%d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+    if (n < 3 || tm.tm_mon < 1 || tm.tm_mon > 12 || tm.tm_mday < 1 || tm.tm_mday > 31) return false;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    *seconds = (int64_t) timegm(&tm);
+    return true;
+}
+
+void page_end(Renderer *renderer)
+{
+    // the front matter has the last word on the date of a page
+    size_t size;
+    const char *date = htmd_meta(renderer->ctx, "date", &size);
+    int64_t seconds;
+    if (date != NULL && parse_date(date, size, &seconds)) renderer->page.mtime = seconds;
+    Batch_Page *page = &renderer->page;
+    Batch_Strings *strings = &renderer->pages.strings;
+    if (strings->count > page->text && strings->items[strings->count-1] == ' ') strings->count -= 1;
+    page->text_size = strings->count - page->text;
+    strings_append(strings, "", 1);
+    page->title = strings_push(strings, renderer->title, renderer->title_size);
+    pages_push(&renderer->pages, *page);
+}
+
+const char* renderer_link(void *user, const char *target, size_t size, size_t line, size_t *new_size)
+{
+    Renderer *renderer = user;
+    const char *rewritten = NULL;
+    if (renderer->links != NULL) rewritten = htmd_links_rewrite(renderer->links, target, size, line, new_size);
+    if (renderer->batch->options.links != NULL){
+        if (rewritten != NULL) record_link(renderer, rewritten, *new_size, target, size, line);
+        else record_link(renderer, target, size, target, size, line);
+    }
+    return rewritten;
+}
+
+void renderer_init(Batch *batch, Renderer *renderer)
+{
+    *renderer = (Renderer) {.batch = batch};
+    Htmd_Options options = {
+        .heading_ids = batch->options.heading_ids,
+        .toc = batch->options.toc,
+        .format = batch->options.format,
+        .text_link_urls = batch->options.text_link_urls,
+        .text_code = batch->options.text_code,
+    };
+    if (batch->options.md_links) renderer->links = htmd_links_create(BATCH_LINKS_MEMORY);
+    if (batch->options.md_links || batch->options.links != NULL){
+        options.link = renderer_link;
+        options.link_user = renderer;
+    }
+    const Template *template = batch->options.template;
+    renderer->titles = batch->options.pages != NULL || (template != NULL && template->has[Template_Title]);
+    if (template != NULL) options.toc_apart = template->has[Template_Toc];
+    renderer->iov = malloc((template != NULL ? template->count : 3)*sizeof(*renderer->iov));
+    assert(renderer->iov != NULL && "Buy more RAM");
+    if (renderer->titles || (batch->options.links != NULL && (batch->options.heading_ids || batch->options.toc || options.toc_apart))){
+        options.heading = renderer_heading;
+        options.heading_user = renderer;
+    }
+    if (batch->options.search != NULL) renderer->search = search_builder_create();
+    if (batch->options.pages != NULL || batch->options.search != NULL){
+        options.text = renderer_text;
+        options.text_user = renderer;
+    }
+    renderer->ctx = htmd_create(&options);
+}
+
+void renderer_free(Renderer *renderer)
+{
+    Batch *batch = renderer->batch;
+    if (batch->options.links != NULL){
+        pthread_mutex_lock(&batch->lock);
+        links_merge(batch->options.links, &renderer->collected);
+        pthread_mutex_unlock(&batch->lock);
+    }
+    if (batch->options.pages != NULL){
+        pthread_mutex_lock(&batch->lock);
+        pages_merge(batch->options.pages, &renderer->pages);
+        pthread_mutex_unlock(&batch->lock);
+    }
+    if (renderer->search != NULL){
+        pthread_mutex_lock(&batch->lock);
+        search_index_merge(batch->options.search, renderer->search);
+        pthread_mutex_unlock(&batch->lock);
+    }
+    batch_links_free(&renderer->collected);
+    batch_pages_free(&renderer->pages);
+    free(renderer->iov);
+    htmd_destroy(renderer->ctx);
+    htmd_links_destroy(renderer->links);
+}
+
+// Points renderer->iov at the pieces of the page of the last render: the
+// template filled with it, or its HTML between prefix and suffix. Returns
+// their count.
+size_t renderer_page(Renderer *renderer, const char *html, size_t size, size_t *total)
+{
+    Batch_Options *options = &renderer->batch->options;
+    const Template *template = options->template;
+    if (template == NULL){
+        renderer->iov[0] = (struct iovec) {(void*) options->prefix, options->prefix_size};
+        renderer->iov[1] = (struct iovec) {(void*) html, size};
+        renderer->iov[2] = (struct iovec) {(void*) options->suffix, options->suffix_size};
+        *total = options->prefix_size + size + options->suffix_size;
+        return 3;
+    }
+    Template_Values values = {.content = html, .content_size = size};
+    if (template->has[Template_Title]){
+        values.title = renderer->title_html;
+        values.title_size = template_escape(renderer->title, renderer->title_size, renderer->title_html, sizeof(renderer->title_html));
+    }
+    if (template->has[Template_Toc]) values.toc = htmd_toc(renderer->ctx, &values.toc_size);
+    *total = template_fill(template, &values, renderer->iov);
+    return template->count;
+}
+
+const char* render(Renderer *renderer, const Job *job, const char *input, size_t len, size_t *size, Batch_Report *report)
+{
+    if (renderer->links != NULL) htmd_links_set_document(renderer->links, job->input);
+    if (renderer->batch->options.links != NULL){
+        size_t dir_len;
+        cwk_path_get_dirname(job->output, &dir_len);
+        if (dir_len == 0 || dir_len >= sizeof(renderer->out_dir)) dir_len = 0;
+        memcpy(renderer->out_dir, job->output, dir_len);
+        renderer->out_dir[dir_len] = '\0';
+        if (cwk_path_normalize(job->output, renderer->output, sizeof(renderer->output)) >= sizeof(renderer->output)){
+            renderer->output[0] = '\0';
+        }
+        strcpy(renderer->anchor, renderer->output);
+        renderer->job = job;
+        renderer->source = SIZE_MAX;
+    }
+    bool page = renderer->batch->options.pages != NULL;
+    if (page) page_begin(renderer, job, report);
+    if (renderer->search != NULL) search_begin(renderer->search, job->output);
+    renderer->titled = false;
+    renderer->title_size = 0;
+    const char *html = htmd_render(renderer->ctx, input, len, size);
+    // the front matter has the last word on the title
+    size_t title_size;
+    const char *title = renderer->titles ? htmd_meta(renderer->ctx, "title", &title_size) : NULL;
+    if (title != NULL) renderer_set_title(renderer, title, title_size);
+    if (page) page_end(renderer);
+    if (renderer->search != NULL) search_end(renderer->search);
+    return html;
+}
+
+void* blocking_thread(void *arg)
+{
+    Batch *batch = arg;
+    Batch_Report report = {0};
+    Renderer renderer;
+    renderer_init(batch, &renderer);
+    for (;;){
+        pthread_mutex_lock(&batch->lock);
+        while (batch->pending.head == NULL && !batch->closed) pthread_cond_wait(&batch->cond, &batch->lock);
+        Job *job = job_pop(&batch->pending);
+        pthread_mutex_unlock(&batch->lock);
+        if (job == NULL) break;
+
+        size_t len;
+        char *input = read_input(job->input, &len, &report);
+        bool ok = input != NULL;
+        if (ok){
+            size_t size;
+            const char *html = render(&renderer, job, input, len, &size, &report);
+            report.input_bytes += len;
+            if (html == NULL){
+                report_failure("render", job->input, ENOMEM);
+                ok = false;
+            }else{
+                size_t total;
+                size_t n = renderer_page(&renderer, html, size, &total);
+                ok = write_output(batch, job->output, renderer.iov, n, total, &report);
+            }
+        }
+        if (ok) report.files += 1;
+        else report.failed += 1;
+        free(input);
+        job_free(job);
+    }
+    renderer_free(&renderer);
+    report_merge(batch, &report);
+    return NULL;
+}
+
+// io_uring
+
+void wake_io_thread(Batch *batch)
+{
+    if (!atomic_exchange(&batch->io_sleeping, false)) return;
+    uint64_t one = 1;
+    if (write(batch->event_fd, &one, sizeof(one)) == sizeof(one)) atomic_fetch_add(&batch->wakeups, 1);
+}
+
+void* render_thread(void *arg)
+{
+    Batch *batch = arg;
+    Batch_Report report = {0};
+    Renderer renderer;
+    renderer_init(batch, &renderer);
+    for (;;){
+        pthread_mutex_lock(&batch->lock);
+        while (batch->ready.head == NULL && !batch->io_done) pthread_cond_wait(&batch->cond, &batch->lock);
+        Job *job = job_pop(&batch->ready);
+        pthread_mutex_unlock(&batch->lock);
+        if (job == NULL) break;
+
+        const char *input = batch->buffers + (size_t) job->buffer*URING_BUFFER_SIZE;
+        char *whole = NULL;
+        if (job->truncated){
+            // rare enough to read it again, the blocking way
+            whole = read_input(job->input, &job->input_size, &report);
+            if (whole == NULL){
+                job->error = -EIO;
+                job->failed = NULL;
+            }
+            input = whole;
+        }
+        if (input != NULL && batch->options.if_changed){
+            // comparing with the old output needs it mapped, so it's written
+            // here, the blocking way
+            size_t size;
+            const char *html = render(&renderer, job, input, job->input_size, &size, &report);
+            job->written = true;
+            if (html == NULL){
+                job->error = -ENOMEM;
+                job->failed = "render";
+            }else{
+                size_t total;
+                size_t n = renderer_page(&renderer, html, size, &total);
+                if (!write_output(batch, job->output, renderer.iov, n, total, &report)){
+                    job->error = -EIO;
+                    job->failed = NULL;
+                }
+            }
+        }else if (input != NULL){
+            size_t size;
+            const char *html = render(&renderer, job, input, job->input_size, &size, &report);
+            // the context is reused for the next file before this one is
+            // written; a filled template is copied whole, the prefix and
+            // suffix are written from where they are
+            size_t total = size;
+            size_t n = batch->options.template != NULL && html != NULL ? renderer_page(&renderer, html, size, &total) : 0;
+            job->html = html != NULL ? malloc(total) : NULL;
+            if (job->html != NULL){
+                if (n == 0) memcpy(job->html, html, size);
+                size_t at = 0;
+                for (size_t i = 0; i < n; ++i){
+                    memcpy(job->html + at, renderer.iov[i].iov_base, renderer.iov[i].iov_len);
+                    at += renderer.iov[i].iov_len;
+                }
+                job->html_size = total;
+            }else{
+                job->error = -ENOMEM;
+                job->failed = "render";
+            }
+        }
+        free(whole);
+
+        pthread_mutex_lock(&batch->lock);
+        job_push(&batch->rendered, job);
+        pthread_mutex_unlock(&batch->lock);
+        wake_io_thread(batch);
+    }
+    renderer_free(&renderer);
+    report_merge(batch, &report);
+    return NULL;
+}
+
+typedef struct{
+    Job *read_slots[URING_BUFFERS];  // in flight per read buffer
+    unsigned free_buffers[URING_BUFFERS];
+    size_t free_buffer_count;
+    unsigned free_slots[URING_SLOTS - URING_BUFFERS];
+    size_t free_slot_count;
+    size_t in_flight;                // jobs taken from `pending` and not finished
+    uint64_t event;
+    Batch_Report report;
+} Io_State;
+
+uint64_t op_data(Job *job, Op op)
+{
+    return (uint64_t) (uintptr_t) job | op;
+}
+
+bool queue_event_read(Batch *batch, Io_State *io)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&batch->ring);
+    if (sqe == NULL) return false;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = batch->event_fd;
+    sqe->addr = (uintptr_t) &io->event;
+    sqe->len = sizeof(io->event);
+    sqe->user_data = op_data(NULL, Op_Event);
+    return true;
+}
+
+// queues openat -> read_fixed -> close; the ring has room for the three entries
+void queue_read(Batch *batch, Io_State *io, Job *job)
+{
+    unsigned buffer = io->free_buffers[--io->free_buffer_count];
+    job->buffer = buffer;
+    job->pending = 3;
+    io->read_slots[buffer] = job;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&batch->ring);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t) job->input;
+    sqe->open_flags = O_RDONLY; // direct descriptors refuse O_CLOEXEC
+    sqe->file_index = buffer + 1;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = op_data(job, Op_Open_Input);
+
+    sqe = uring_get_sqe(&batch->ring);
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = buffer;
+    sqe->addr = (uintptr_t) (batch->buffers + (size_t) buffer*URING_BUFFER_SIZE);
+    sqe->len = URING_BUFFER_SIZE;
+    sqe->buf_index = buffer;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    sqe->user_data = op_data(job, Op_Read);
+
+    sqe = uring_get_sqe(&batch->ring);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = buffer + 1;
+    sqe->user_data = op_data(job, Op_Close_Input);
+}
+
+// queues openat -> writev -> close
+void queue_write(Batch *batch, Io_State *io, Job *job)
+{
+    unsigned slot = io->free_slots[--io->free_slot_count];
+    job->slot = slot;
+    job->pending = 3;
+    job->iov[0] = (struct iovec) {(void*) batch->options.prefix, batch->options.prefix_size};
+    job->iov[1] = (struct iovec) {job->html, job->html_size};
+    job->iov[2] = (struct iovec) {(void*) batch->options.suffix, batch->options.suffix_size};
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&batch->ring);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t) job->output;
+    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    sqe->len = 0644;
+    sqe->file_index = slot + 1;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = op_data(job, Op_Open_Output);
+
+    sqe = uring_get_sqe(&batch->ring);
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = slot;
+    sqe->addr = (uintptr_t) job->iov;
+    sqe->len = 3;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    sqe->user_data = op_data(job, Op_Write);
+
+    sqe = uring_get_sqe(&batch->ring);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = slot + 1;
+    sqe->user_data = op_data(job, Op_Close_Output);
+}
+
+void finish_job(Io_State *io, Job *job, bool ok)
+{
+    if (ok) io->report.files += 1;
+    else io->report.failed += 1;
+    io->in_flight -= 1;
+    job_free(job);
+}
+
+// the error of a linked operation that was cancelled is that of the one before
+void note_error(Job *job, int res, const char *what)
+{
+    if (res < 0 && job->error == 0){
+        job->error = res;
+        job->failed = what;
+    }
+}
+
+void handle_completion(Batch *batch, Io_State *io, struct io_uring_cqe *cqe)
+{
+    Op op = cqe->user_data & 7;
+    Job *job = (Job*) (uintptr_t) (cqe->user_data & ~(uint64_t) 7);
+    switch (op){
+        case Op_Event:{
+            queue_event_read(batch, io);
+        }return;
+        case Op_Open_Input:{
+            note_error(job, cqe->res, "open");
+        }break;
+        case Op_Read:{
+            note_error(job, cqe->res, "read");
+            if (cqe->res >= 0){
+                job->input_size = cqe->res;
+                job->truncated = job->input_size == URING_BUFFER_SIZE;
+            }
+        }break;
+        case Op_Open_Output:{
+            note_error(job, cqe->res, "create");
+        }break;
+        case Op_Write:{
+            size_t total = batch->options.prefix_size + job->html_size + batch->options.suffix_size;
+            if (cqe->res >= 0 && (size_t) cqe->res != total) note_error(job, -EIO, "write");
+            else note_error(job, cqe->res, "write");
+        }break;
+        case Op_Close_Input:
+        case Op_Close_Output:
+        break;
+    }
+    if (--job->pending > 0) return;
+
+    bool read_stage = op <= Op_Close_Input;
+    if (job->error != 0){
+        report_failure(job->failed, read_stage ? job->input : job->output, -job->error);
+    }
+    if (read_stage){
+        if (job->error != 0){
+            io->free_buffers[io->free_buffer_count++] = job->buffer;
+            finish_job(io, job, false);
+            return;
+        }
+        io->report.input_bytes += job->input_size;
+        pthread_mutex_lock(&batch->lock);
+        job_push(&batch->ready, job);
+        pthread_cond_signal(&batch->cond);
+        pthread_mutex_unlock(&batch->lock);
+    }else{
+        io->free_slots[io->free_slot_count++] = job->slot;
+        if (job->error == 0) io->report.output_bytes += job->iov[0].iov_len + job->iov[1].iov_len + job->iov[2].iov_len;
+        finish_job(io, job, job->error == 0);
+    }
+}
+
+void* io_thread(void *arg)
+{
+    Batch *batch = arg;
+    Io_State *io = calloc(1, sizeof(*io));
+    for (unsigned i = 0; i < URING_BUFFERS; ++i) io->free_buffers[io->free_buffer_count++] = URING_BUFFERS - 1 - i;
+    for (unsigned i = URING_BUFFERS; i < URING_SLOTS; ++i) io->free_slots[io->free_slot_count++] = i;
+    queue_event_read(batch, io);
+
+    for (;;){
+        // take what is ready to start, while the ring has room for its chain
+        pthread_mutex_lock(&batch->lock);
+        Job *job;
+        while (batch->rendered.head != NULL && io->free_slot_count > 0 && uring_sq_space(&batch->ring) >= 3){
+            job = job_pop(&batch->rendered);
+            // a rendered job has given its read buffer back
+            io->free_buffers[io->free_buffer_count++] = job->buffer;
+            if (job->error != 0){
+                if (job->failed != NULL) report_failure(job->failed, job->input, -job->error);
+                finish_job(io, job, false);
+                continue;
+            }
+            if (job->written){
+                finish_job(io, job, true);
+                continue;
+            }
+            queue_write(batch, io, job);
+        }
+        while (batch->pending.head != NULL && io->free_buffer_count > 0 && uring_sq_space(&batch->ring) >= 3){
+            job = job_pop(&batch->pending);
+            io->in_flight += 1;
+            queue_read(batch, io, job);
+        }
+        bool done = batch->closed && batch->pending.head == NULL && io->in_flight == 0;
+        pthread_mutex_unlock(&batch->lock);
+        if (done) break;
+
+        // sleep in the kernel unless there's more to do; a render thread or
+        // batch_add() posts to the event fd to wake us up
+        bool queued = batch->ring.sq_queued > 0;
+        unsigned wait = 0;
+        if (!queued){
+            atomic_store(&batch->io_sleeping, true);
+            pthread_mutex_lock(&batch->lock);
+            bool work = (batch->rendered.head != NULL && io->free_slot_count > 0)
+                     || (batch->pending.head != NULL && io->free_buffer_count > 0)
+                     || (batch->closed && batch->pending.head == NULL && io->in_flight == 0);
+            pthread_mutex_unlock(&batch->lock);
+            if (work) atomic_store(&batch->io_sleeping, false);
+            else wait = 1;
+        }
+        if (queued || wait > 0){
+            if (uring_submit(&batch->ring, wait) < 0 && errno != EBUSY){
+                fprintf(stderr, "[ERROR] io_uring_enter failed: %s\n", strerror(errno));
+                abort();
+            }
+        }
+        atomic_store(&batch->io_sleeping, false);
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&batch->ring)) != NULL){
+            handle_completion(batch, io, cqe);
+            uring_cqe_seen(&batch->ring);
+        }
+    }
+
+    pthread_mutex_lock(&batch->lock);
+    batch->io_done = true;
+    pthread_cond_broadcast(&batch->cond);
+    pthread_mutex_unlock(&batch->lock);
+    report_merge(batch, &io->report);
+    free(io);
+    return NULL;
+}
+
+bool uring_start(Batch *batch)
+{
+    if (!uring_init(&batch->ring, URING_ENTRIES)) return false;
+    batch->buffers = aligned_alloc(4096, (size_t) URING_BUFFERS*URING_BUFFER_SIZE);
+    if (batch->buffers == NULL) goto fail;
+    struct iovec iov[URING_BUFFERS];
+    for (size_t i = 0; i < URING_BUFFERS; ++i){
+        iov[i] = (struct iovec) {batch->buffers + i*URING_BUFFER_SIZE, URING_BUFFER_SIZE};
+    }
+    if (uring_register(&batch->ring, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) < 0) goto fail;
+    // an empty table for the direct descriptors (Linux 5.19)
+    struct io_uring_rsrc_register files = {.nr = URING_SLOTS, .flags = IORING_RSRC_REGISTER_SPARSE};
+    if (uring_register(&batch->ring, IORING_REGISTER_FILES2, &files, sizeof(files)) < 0) goto fail;
+    batch->event_fd = eventfd(0, EFD_CLOEXEC);
+    batch->ring.syscalls += 1;
+    if (batch->event_fd < 0) goto fail;
+    return true;
+
+  fail:
+    uring_free(&batch->ring);
+    free(batch->buffers);
+    batch->buffers = NULL;
+    return false;
+}
+
+size_t cpu_count(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+Batch* batch_start(const Batch_Options *options)
+{
+    Batch *batch = calloc(1, sizeof(*batch));
+    if (batch == NULL) return NULL;
+    batch->options = *options;
+    // a template takes the place of the prefix and suffix
+    if (options->template != NULL){
+        batch->options.prefix_size = 0;
+        batch->options.suffix_size = 0;
+    }
+    batch->event_fd = -1;
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->cond, NULL);
+
+    if (options->io != Batch_Io_Blocking){
+        batch->uring = uring_start(batch);
+        if (!batch->uring && options->io == Batch_Io_Uring){
+            fprintf(stderr, "[WARNING] io_uring is not available, using blocking I/O\n");
+        }
+    }
+    batch->report.uring = batch->uring;
+
+    batch->thread_count = options->threads > 0 ? options->threads : cpu_count();
+    batch->threads = calloc(batch->thread_count, sizeof(*batch->threads));
+    for (size_t i = 0; i < batch->thread_count; ++i){
+        pthread_create(&batch->threads[i], NULL, batch->uring ? render_thread : blocking_thread, batch);
+    }
+    if (batch->uring) pthread_create(&batch->io_thread, NULL, io_thread, batch);
+    return batch;
+}
+
+void batch_add(Batch *batch, const char *input, const char *output)
+{
+    size_t input_len = strlen(input) + 1;
+    size_t output_len = strlen(output) + 1;
+    // the paths live in the same allocation; jobs are 8 byte aligned, which
+    // leaves the low bits of their address for the io_uring operation
+    Job *job = malloc(sizeof(Job) + input_len + output_len);
+    assert(job != NULL && "Buy more RAM");
+    *job = (Job) {.input = (char*) (job + 1)};
+    job->output = job->input + input_len;
+    memcpy(job->input, input, input_len);
+    memcpy(job->output, output, output_len);
+
+    pthread_mutex_lock(&batch->lock);
+    job_push(&batch->pending, job);
+    if (!batch->uring) pthread_cond_signal(&batch->cond);
+    pthread_mutex_unlock(&batch->lock);
+    if (batch->uring) wake_io_thread(batch);
+}
+
+void batch_finish(Batch *batch, Batch_Report *report)
+{
+    pthread_mutex_lock(&batch->lock);
+    batch->closed = true;
+    pthread_cond_broadcast(&batch->cond);
+    pthread_mutex_unlock(&batch->lock);
+    if (batch->uring){
+        wake_io_thread(batch);
+        pthread_join(batch->io_thread, NULL);
+    }
+    for (size_t i = 0; i < batch->thread_count; ++i) pthread_join(batch->threads[i], NULL);
+
+    if (batch->uring){
+        batch->report.syscalls += batch->ring.syscalls + atomic_load(&batch->wakeups);
+        uring_free(&batch->ring);
+        close(batch->event_fd);
+        free(batch->buffers);
+    }
+    if (report != NULL) *report = batch->report;
+    pthread_cond_destroy(&batch->cond);
+    pthread_mutex_destroy(&batch->lock);
+    free(batch->threads);
+    free(batch);
+}
@@ -0,0 +1,111 @@
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <htmd.h>
+#include "search.h"
+#include "template.h"
+
+// Renders many files at once: render threads are fed by either blocking
+// reads and writes or, where the kernel supports it, one thread driving
+// io_uring, which keeps many opens, reads and writes in flight.
+
+// NUL-terminated strings, referred to by their offset.
+typedef struct{
+    char *items;
+    size_t count;
+    size_t capacity;
+} Batch_Strings;
+
+// A relative link of a rendered file. The strings are at offsets into
+// Batch_Links.strings.
+typedef struct{
+    size_t source;        // the input
+    size_t target;        // as in the HTML, after rewriting
+    size_t original;      // as in the markdown, the same offset when it wasn't rewritten
+    size_t line;
+    Htmd_Hash resolved;   // of the normalized path of the output it leads to, fragment and query left out
+    Htmd_Hash anchor;     // of that path, '#' and the fragment when it is a heading of a page, else zero
+} Batch_Link;
+
+typedef struct{
+    Batch_Link *items;
+    size_t count;
+    size_t capacity;
+    Batch_Strings strings;
+    // the headings of the rendered files (with heading_ids), hashed like Batch_Link.anchor
+    Htmd_Hash *anchors;
+    size_t anchor_count;
+    size_t anchor_capacity;
+} Batch_Links;
+
+void batch_links_free(Batch_Links *links);
+
+// A rendered file, with what is needed to describe it. The strings are at
+// offsets into Batch_Pages.strings.
+typedef struct{
+    size_t output;
+    size_t title;         // of its front matter, else the text of its first heading, empty without either
+    size_t text;          // the text of the document, see Htmd_Text_Fn; lines are separated by a space
+    size_t text_size;
+    int64_t mtime;        // the date of its front matter, else of the input, in seconds since the epoch
+} Batch_Page;
+
+typedef struct{
+    Batch_Page *items;
+    size_t count;
+    size_t capacity;
+    Batch_Strings strings;
+} Batch_Pages;
+
+void batch_pages_free(Batch_Pages *pages);
+
+typedef enum{
+    Batch_Io_Auto,     // io_uring if available
+    Batch_Io_Blocking,
+    Batch_Io_Uring,
+} Batch_Io;
+
+typedef struct{
+    Batch_Io io;
+    size_t threads;       // render threads, 0: one per CPU
+    const char *prefix;   // written before and after every document
+    size_t prefix_size;
+    const char *suffix;
+    size_t suffix_size;
+    const Template *template; // filled with every document instead, takes the place of prefix and suffix
+    bool if_changed;      // leave outputs that wouldn't change alone, see write_if_changed()
+    bool md_links;        // point links to .md files at their .html, see htmd_links_rewrite()
+    bool heading_ids;     // see Htmd_Options
+    bool toc;
+    Htmd_Format format;
+    bool text_link_urls;
+    bool text_code;
+    Batch_Links *links;   // when set, the relative links of every file are added here
+    Batch_Pages *pages;   // when set, every rendered file is added here
+    Search_Index *search; // when set, the words of every rendered file are added here
+} Batch_Options;
+
+typedef struct{
+    size_t files;
+    size_t unchanged;     // of the files, those whose output was already up to date
+    size_t failed;
+    size_t input_bytes;
+    size_t output_bytes;  // actually written
+    size_t syscalls;      // made for file I/O, including io_uring's own; thread synchronization isn't counted
+    bool uring;
+} Batch_Report;
+
+typedef struct Batch Batch;
+
+Batch* batch_start(const Batch_Options *options);
+// Queues rendering `input` into `output`, whose directory has to exist.
+// Can be called from any thread.
+void batch_add(Batch *batch, const char *input, const char *output);
+// Waits until every queued file is done and frees the batch.
+void batch_finish(Batch *batch, Batch_Report *report);
+
+#endif // _BATCH_H
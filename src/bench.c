@@ -0,0 +1,185 @@
+// Concurrent stress benchmark: renders the given files from 1, 2, 4, ... threads,
+// one context per thread, and checks every result against a single threaded
+// reference render.
+//
+//   make bench && ./build/bench [-t max_threads] [-n rounds] [-c cache_bytes] [-b block_cache_bytes] file.md...
+//
+// With -c all threads render through one shared Htmd_Cache, with -b every
+// thread has an Htmd_Block_Cache of its own.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <htmd.h>
+
+#define NOB_IMPLEMENTATION
+#define NOB_STRIP_PREFIX
+#include <nob.h>
+
+#define eprintfn(msg, ...) do{fprintf(stderr, "[ERROR] " msg "\n", ##__VA_ARGS__);}while(0)
+
+typedef struct{
+    String_Builder content;
+    uint64_t hash; // of the reference render
+} Doc;
+
+typedef struct{
+    Doc *items;
+    size_t count;
+    size_t capacity;
+} Docs;
+
+typedef struct{
+    pthread_t thread;
+    const Docs *docs;
+    Htmd_Cache *cache;
+    size_t block_cache_bytes;
+    size_t first;    // index into the shared sequence of renders
+    size_t count;
+    size_t bytes;
+    size_t mismatches;
+} Worker;
+
+static atomic_bool go;
+
+uint64_t hash_bytes(const char *data, size_t size)
+{
+    uint64_t h = 0xcbf29ce484222325;
+    for (size_t i = 0; i < size; ++i) {
+        h ^= (unsigned char) data[i];
+        h *= 0x100000001b3;
+    }
+    return h;
+}
+
+double seconds_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+void* worker_run(void *arg)
+{
+    Worker *w = arg;
+    Htmd_Options options = {0};
+    if (w->block_cache_bytes > 0) options.block_cache = htmd_block_cache_create(w->block_cache_bytes);
+    Htmd_Context *ctx = htmd_create(&options);
+    while (!atomic_load(&go)) sched_yield();
+
+    for (size_t i = w->first; i < w->first + w->count; ++i) {
+        const Doc *doc = &w->docs->items[i % w->docs->count];
+        size_t size;
+        const char *html = w->cache != NULL
+            ? htmd_render_cached(w->cache, ctx, doc->content.items, doc->content.count, &size)
+            : htmd_render(ctx, doc->content.items, doc->content.count, &size);
+        if (hash_bytes(html, size) != doc->hash) w->mismatches++;
+        w->bytes += doc->content.count;
+    }
+
+    htmd_destroy(ctx);
+    htmd_block_cache_destroy(options.block_cache);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    const char *program = shift(argv, argc);
+    size_t max_threads = 64;
+    size_t rounds = 200;
+    size_t cache_bytes = 0;
+    size_t block_cache_bytes = 0;
+    Docs docs = {0};
+
+    while (argc > 0) {
+        const char *arg = shift(argv, argc);
+        if ((strcmp(arg, "-c") == 0 || strcmp(arg, "-b") == 0) && argc > 0) {
+            size_t n = strtoul(shift(argv, argc), NULL, 10);
+            if (arg[1] == 'c') cache_bytes = n;
+            else block_cache_bytes = n;
+            continue;
+        }
+        if ((strcmp(arg, "-t") == 0 || strcmp(arg, "-n") == 0) && argc > 0) {
+            size_t n = strtoul(shift(argv, argc), NULL, 10);
+            if (n == 0) n = 1;
+            if (arg[1] == 't') max_threads = n;
+            else rounds = n;
+            continue;
+        }
+        Doc doc = {0};
+        if (!read_entire_file(arg, &doc.content)) return 1;
+        da_append(&docs, doc);
+    }
+    if (docs.count == 0) {
+        eprintfn("Usage: %s [-t max_threads] [-n rounds] [-c cache_bytes] [-b block_cache_bytes] file.md...", program);
+        return 1;
+    }
+
+    size_t corpus_bytes = 0;
+    Htmd_Context *ctx = htmd_create(NULL);
+    da_foreach(Doc, doc, &docs) {
+        size_t size;
+        const char *html = htmd_render(ctx, doc->content.items, doc->content.count, &size);
+        doc->hash = hash_bytes(html, size);
+        corpus_bytes += doc->content.count;
+    }
+    htmd_destroy(ctx);
+
+    // the total amount of work is the same for every thread count
+    size_t total = rounds*docs.count;
+    printf("%zu files, %zu bytes, %zu renders per run\n", docs.count, corpus_bytes, total);
+    printf("threads       MB/s   speedup%s\n", cache_bytes > 0 ? "   hit rate  evictions" : "");
+
+    Worker *workers = malloc(max_threads*sizeof(*workers));
+    double base = 0;
+    bool ok = true;
+    for (size_t n = 1; n <= max_threads; n *= 2) {
+        atomic_store(&go, false);
+        // every thread count starts with an empty cache
+        Htmd_Cache *cache = cache_bytes > 0 ? htmd_cache_create(cache_bytes) : NULL;
+        for (size_t i = 0; i < n; ++i) {
+            workers[i] = (Worker) {
+                .docs = &docs,
+                .cache = cache,
+                .block_cache_bytes = block_cache_bytes,
+                .first = total*i/n,
+                .count = total*(i + 1)/n - total*i/n,
+            };
+            if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0) {
+                eprintfn("Could not create thread %zu", i);
+                return 1;
+            }
+        }
+
+        double start = seconds_now();
+        atomic_store(&go, true);
+        size_t bytes = 0, mismatches = 0;
+        for (size_t i = 0; i < n; ++i) {
+            pthread_join(workers[i].thread, NULL);
+            bytes += workers[i].bytes;
+            mismatches += workers[i].mismatches;
+        }
+        double rate = bytes/(seconds_now() - start)/1e6;
+        if (n == 1) base = rate;
+
+        printf("%7zu %10.1f %8.2fx", n, rate, rate/base);
+        if (cache != NULL) {
+            Htmd_Cache_Stats cs = htmd_cache_stats(cache);
+            printf(" %9.1f%% %10zu", 100.0*cs.hits/(cs.hits + cs.misses), cs.evictions);
+            htmd_cache_destroy(cache);
+        }
+        printf("\n");
+        if (mismatches > 0) {
+            eprintfn("%zu renders with %zu threads differ from the reference", mismatches, n);
+            ok = false;
+        }
+    }
+
+    free(workers);
+    da_foreach(Doc, doc, &docs) sb_free(doc->content);
+    da_free(docs);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,487 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <cwalk.h>
+#include "build.h"
+#include "output.h"
+
+#define NOB_STRIP_PREFIX
+#include <nob.h>
+
+// The tree is listed by several walker threads. Every walker owns a deque of
+// directories still to be read: it takes from the back of its own, depth
+// first so few directories are open at a time, and when that runs dry it
+// steals from the front of another's, where the directories closest to the
+// root (the biggest pieces of work) are. Markdown files go straight to the
+// batch, so rendering starts with the first directory read.
+//
+// Directories are opened with openat() relative to their parent and read
+// with getdents64(), whose d_type spares a stat() per entry on most file
+// systems. Listing is mostly waiting on the file system, so there are at
+// least WALK_MIN_THREADS walkers even on few CPUs.
+#define WALK_MIN_THREADS 4
+#define WALK_BUFFER_SIZE (32*1024)
+
+typedef struct{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} Dirent64;
+
+typedef struct Dir{
+    struct Dir *parent;      // until this one is opened
+    atomic_size_t refs;      // itself and its children that aren't open yet
+    int fd;
+    char *src;
+    char *out;
+    char name[];
+} Dir;
+
+typedef struct{
+    pthread_mutex_t lock;
+    Dir **items;
+    size_t top;              // stolen from here
+    size_t bottom;           // the owner pushes and pops here
+    size_t capacity;
+} Deque;
+
+// hashes of the normalized paths of everything the build produces
+typedef struct{
+    Htmd_Hash *items;
+    size_t count;
+    size_t capacity;
+} Outputs;
+
+typedef struct Walk Walk;
+
+typedef struct{
+    Walk *walk;
+    size_t index;
+    Deque deque;
+    size_t directories;
+    size_t assets;
+    size_t assets_unchanged;
+    size_t failed;
+    Outputs outputs;
+    pthread_t thread;
+} Walker;
+
+struct Walk{
+    Batch *batch;
+    bool if_changed;
+    Walker *walkers;
+    size_t walker_count;
+    // the output directory, so it's skipped when it lies inside the source tree
+    dev_t out_dev;
+    ino_t out_ino;
+    atomic_size_t queued;      // directories in the deques
+    atomic_size_t unfinished;  // directories queued or being read
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    size_t idle;               // walkers waiting for work
+};
+
+void deque_push(Deque *deque, Dir *dir)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom == deque->capacity){
+        if (deque->top > 0){
+            memmove(deque->items, deque->items + deque->top, (deque->bottom - deque->top)*sizeof(*deque->items));
+            deque->bottom -= deque->top;
+            deque->top = 0;
+        }else{
+            deque->capacity = deque->capacity == 0 ? 64 : 2*deque->capacity;
+            deque->items = realloc(deque->items, deque->capacity*sizeof(*deque->items));
+            assert(deque->items != NULL && "Buy more RAM");
+        }
+    }
+    deque->items[deque->bottom++] = dir;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+Dir* deque_take(Deque *deque, bool steal)
+{
+    Dir *dir = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top){
+        dir = steal ? deque->items[deque->top++] : deque->items[--deque->bottom];
+        if (deque->top == deque->bottom) deque->top = deque->bottom = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return dir;
+}
+
+// "dir/name", or "name" under "."
+char* path_append(const char *dir, const char *name, size_t name_len)
+{
+    size_t dir_len = strcmp(dir, ".") == 0 ? 0 : strlen(dir);
+    if (dir_len == 0) return strndup(name, name_len);
+    char *path = malloc(dir_len + 1 + name_len + 1);
+    assert(path != NULL && "Buy more RAM");
+    memcpy(path, dir, dir_len);
+    path[dir_len] = '/';
+    memcpy(path + dir_len + 1, name, name_len);
+    path[dir_len + 1 + name_len] = '\0';
+    return path;
+}
+
+void dir_release(Dir *dir)
+{
+    if (atomic_fetch_sub(&dir->refs, 1) > 1) return;
+    if (dir->fd >= 0) close(dir->fd);
+    free(dir->src);
+    free(dir->out);
+    free(dir);
+}
+
+void walk_push(Walker *walker, Dir *parent, const char *name)
+{
+    Walk *walk = walker->walk;
+    size_t name_len = strlen(name);
+    Dir *dir = malloc(sizeof(*dir) + name_len + 1);
+    assert(dir != NULL && "Buy more RAM");
+    dir->parent = parent;
+    atomic_init(&dir->refs, 1);
+    dir->fd = -1;
+    dir->src = path_append(parent->src, name, name_len);
+    dir->out = path_append(parent->out, name, name_len);
+    memcpy(dir->name, name, name_len + 1);
+    atomic_fetch_add(&parent->refs, 1);
+
+    atomic_fetch_add(&walk->unfinished, 1);
+    deque_push(&walker->deque, dir);
+    atomic_fetch_add(&walk->queued, 1);
+    pthread_mutex_lock(&walk->idle_lock);
+    if (walk->idle > 0) pthread_cond_signal(&walk->idle_cond);
+    pthread_mutex_unlock(&walk->idle_lock);
+}
+
+// the next directory to read, NULL once the whole tree is done
+Dir* walk_take(Walker *walker)
+{
+    Walk *walk = walker->walk;
+    for (;;){
+        Dir *dir = deque_take(&walker->deque, false);
+        for (size_t i = 1; dir == NULL && i < walk->walker_count; ++i){
+            dir = deque_take(&walk->walkers[(walker->index + i) % walk->walker_count].deque, true);
+        }
+        if (dir != NULL){
+            atomic_fetch_sub(&walk->queued, 1);
+            return dir;
+        }
+        pthread_mutex_lock(&walk->idle_lock);
+        while (atomic_load(&walk->queued) == 0 && atomic_load(&walk->unfinished) > 0){
+            walk->idle += 1;
+            pthread_cond_wait(&walk->idle_cond, &walk->idle_lock);
+            walk->idle -= 1;
+        }
+        bool done = atomic_load(&walk->unfinished) == 0;
+        pthread_mutex_unlock(&walk->idle_lock);
+        if (done) return NULL;
+    }
+}
+
+void record_output(Walker *walker, const char *path)
+{
+    char normalized[FILENAME_MAX];
+    size_t len = cwk_path_normalize(path, normalized, sizeof(normalized));
+    if (len >= sizeof(normalized)) return;
+    da_append(&walker->outputs, htmd_hash(normalized, len));
+}
+
+void walk_file(Walker *walker, Dir *dir, const char *name)
+{
+    char src[FILENAME_MAX];
+    char out[FILENAME_MAX];
+    size_t name_len = strlen(name);
+    if (strcmp(dir->src, ".") == 0) snprintf(src, sizeof(src), "%s", name);
+    else snprintf(src, sizeof(src), "%s/%s", dir->src, name);
+    bool markdown = name_len > 3 && memcmp(name + name_len - 3, ".md", 3) == 0;
+    if (markdown){
+        snprintf(out, sizeof(out), "%s/%.*s.html", dir->out, (int) (name_len - 3), name);
+        batch_add(walker->walk->batch, src, out);
+        record_output(walker, out);
+    }else{
+        snprintf(out, sizeof(out), "%s/%s", dir->out, name);
+        if (walker->walk->if_changed){
+            Write_Result result = copy_if_changed(src, out, NULL);
+            if (result == Write_Failed) walker->failed += 1;
+            else walker->assets += 1;
+            if (result == Write_Unchanged) walker->assets_unchanged += 1;
+        }else if (copy_file(src, out)){
+            walker->assets += 1;
+        }else{
+            walker->failed += 1;
+            return;
+        }
+        record_output(walker, out);
+    }
+}
+
+// Hidden entries (.git, ...) and symlinks are left out, the latter so the
+// walk can't loop.
+void walk_dir(Walker *walker, Dir *dir, char *buffer)
+{
+    Walk *walk = walker->walk;
+    if (dir->parent != NULL){
+        dir->fd = openat(dir->parent->fd, dir->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        dir_release(dir->parent);
+        dir->parent = NULL;
+        if (dir->fd < 0){
+            fprintf(stderr, "[ERROR] Could not open directory '%s': %s\n", dir->src, strerror(errno));
+            walker->failed += 1;
+            return;
+        }
+        if (!mkdir_if_not_exists(dir->out)){
+            walker->failed += 1;
+            return;
+        }
+        walker->directories += 1;
+        record_output(walker, dir->out);
+    }
+    for (;;){
+        long n = syscall(SYS_getdents64, dir->fd, buffer, WALK_BUFFER_SIZE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0){
+            fprintf(stderr, "[ERROR] Could not read directory '%s': %s\n", dir->src, strerror(errno));
+            walker->failed += 1;
+        }
+        if (n <= 0) break;
+        for (long offset = 0; offset < n;){
+            Dirent64 *entry = (Dirent64*) (buffer + offset);
+            offset += entry->d_reclen;
+            if (entry->d_name[0] == '.') continue;
+            unsigned char type = entry->d_type;
+            struct stat st;
+            if (type == DT_UNKNOWN && fstatat(dir->fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0){
+                if (S_ISDIR(st.st_mode)) type = DT_DIR;
+                else if (S_ISREG(st.st_mode)) type = DT_REG;
+            }
+            if (type == DT_DIR){
+                if (entry->d_ino == walk->out_ino && fstatat(dir->fd, entry->d_name, &st, 0) == 0 && st.st_dev == walk->out_dev) continue;
+                walk_push(walker, dir, entry->d_name);
+            }else if (type == DT_REG){
+                walk_file(walker, dir, entry->d_name);
+            }
+        }
+    }
+}
+
+void* walker_thread(void *arg)
+{
+    Walker *walker = arg;
+    Walk *walk = walker->walk;
+    _Alignas(8) char buffer[WALK_BUFFER_SIZE];
+    Dir *dir;
+    while ((dir = walk_take(walker)) != NULL){
+        walk_dir(walker, dir, buffer);
+        dir_release(dir);
+        if (atomic_fetch_sub(&walk->unfinished, 1) == 1){
+            pthread_mutex_lock(&walk->idle_lock);
+            pthread_cond_broadcast(&walk->idle_cond);
+            pthread_mutex_unlock(&walk->idle_lock);
+        }
+    }
+    return NULL;
+}
+
+// Link checking
+//
+// The outputs of all walkers and the headings of the pages go into one open
+// addressing hash set, sized once to stay at most half full. Every link
+// already carries the hashes of the path and the heading it leads to, so
+// checking it is a lookup or two.
+
+typedef struct{
+    Htmd_Hash *slots;      // the zero hash marks an empty slot
+    size_t mask;
+} Hash_Set;
+
+void hash_set_init(Hash_Set *set, size_t count)
+{
+    size_t capacity = 16;
+    while (capacity < 2*count) capacity *= 2;
+    set->slots = calloc(capacity, sizeof(*set->slots));
+    assert(set->slots != NULL && "Buy more RAM");
+    set->mask = capacity - 1;
+}
+
+bool hash_set_probe(Hash_Set *set, Htmd_Hash hash, bool insert)
+{
+    for (size_t i = hash.lo & set->mask;; i = (i + 1) & set->mask){
+        Htmd_Hash *slot = &set->slots[i];
+        if (slot->lo == hash.lo && slot->hi == hash.hi) return true;
+        if (slot->lo == 0 && slot->hi == 0){
+            if (insert) *slot = hash;
+            return false;
+        }
+    }
+}
+
+typedef struct{
+    const char *source;
+    size_t line;
+    const char *target;    // as in the markdown
+    bool heading;          // the page is there, the heading isn't
+} Broken_Link;
+
+int compare_broken_links(const void *a, const void *b)
+{
+    const Broken_Link *x = a, *y = b;
+    int order = strcmp(x->source, y->source);
+    if (order != 0) return order;
+    return x->line < y->line ? -1 : x->line > y->line;
+}
+
+void check_links(Walk *walk, const char *root_out, const Batch_Links *links, Build_Report *report)
+{
+    size_t count = 1 + links->anchor_count;
+    for (size_t i = 0; i < walk->walker_count; ++i) count += walk->walkers[i].outputs.count;
+    Hash_Set outputs;
+    hash_set_init(&outputs, count);
+    hash_set_probe(&outputs, htmd_hash(root_out, strlen(root_out)), true);
+    for (size_t i = 0; i < walk->walker_count; ++i){
+        const Outputs *walker_outputs = &walk->walkers[i].outputs;
+        for (size_t j = 0; j < walker_outputs->count; ++j) hash_set_probe(&outputs, walker_outputs->items[j], true);
+    }
+    for (size_t i = 0; i < links->anchor_count; ++i) hash_set_probe(&outputs, links->anchors[i], true);
+
+    struct{
+        Broken_Link *items;
+        size_t count;
+        size_t capacity;
+    } broken = {0};
+    for (size_t i = 0; i < links->count; ++i){
+        const Batch_Link *link = &links->items[i];
+        bool found = hash_set_probe(&outputs, link->resolved, false);
+        bool has_anchor = link->anchor.lo != 0 || link->anchor.hi != 0;
+        if (found && (!has_anchor || hash_set_probe(&outputs, link->anchor, false))) continue;
+        da_append(&broken, ((Broken_Link) {
+            .source = links->strings.items + link->source,
+            .line = link->line,
+            .target = links->strings.items + link->original,
+            .heading = found,
+        }));
+    }
+    // sorted, since the threads found them in any order
+    qsort(broken.items, broken.count, sizeof(*broken.items), compare_broken_links);
+    for (size_t i = 0; i < broken.count; ++i){
+        const Broken_Link *link = &broken.items[i];
+        fprintf(stderr, "[ERROR] %s:%zu: broken link '%s'%s\n", link->source, link->line, link->target, link->heading ? ": no such heading" : "");
+    }
+    report->links = links->count;
+    report->broken_links = broken.count;
+    da_free(broken);
+    free(outputs.slots);
+}
+
+bool build_site(const char *src_dir, const char *out_dir, const Batch_Options *options, const Site_Options *site, Build_Report *report)
+{
+    *report = (Build_Report) {0};
+    struct stat st;
+    if (stat(src_dir, &st) < 0 || !S_ISDIR(st.st_mode)){
+        fprintf(stderr, "[ERROR] '%s' is not a directory\n", src_dir);
+        return false;
+    }
+    dev_t src_dev = st.st_dev;
+    ino_t src_ino = st.st_ino;
+    if (!mkdir_if_not_exists(out_dir)) return false;
+    if (stat(out_dir, &st) < 0){
+        fprintf(stderr, "[ERROR] Could not read stats from '%s': %s\n", out_dir, strerror(errno));
+        return false;
+    }
+    // the assets would be copied onto themselves
+    if (st.st_dev == src_dev && st.st_ino == src_ino){
+        fprintf(stderr, "[ERROR] The output directory can't be the source directory\n");
+        return false;
+    }
+
+    Walk walk = {.if_changed = options->if_changed, .out_dev = st.st_dev, .out_ino = st.st_ino};
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    walk.walker_count = options->threads > 0 ? options->threads : cpus > 0 ? (size_t) cpus : 1;
+    if (walk.walker_count < WALK_MIN_THREADS) walk.walker_count = WALK_MIN_THREADS;
+    // every relative link is checked against the outputs in the end
+    Batch_Links links = {0};
+    Batch_Options batch_options = *options;
+    batch_options.links = &links;
+    // and the pages described by what the render threads saw of them
+    Batch_Pages pages = {0};
+    Search_Index *search = NULL;
+    if (site_wanted(site)) batch_options.pages = &pages;
+    if (site != NULL && site->search_index){
+        search = search_index_create();
+        batch_options.search = search;
+    }
+    walk.batch = batch_start(&batch_options);
+    if (walk.batch == NULL) return false;
+    walk.walkers = calloc(walk.walker_count, sizeof(*walk.walkers));
+    assert(walk.walkers != NULL && "Buy more RAM");
+    pthread_mutex_init(&walk.idle_lock, NULL);
+    pthread_cond_init(&walk.idle_cond, NULL);
+
+    for (size_t i = 0; i < walk.walker_count; ++i){
+        Walker *walker = &walk.walkers[i];
+        walker->walk = &walk;
+        walker->index = i;
+        pthread_mutex_init(&walker->deque.lock, NULL);
+    }
+
+    char root_src[FILENAME_MAX];
+    char root_out[FILENAME_MAX];
+    cwk_path_normalize(src_dir, root_src, sizeof(root_src));
+    cwk_path_normalize(out_dir, root_out, sizeof(root_out));
+    Dir *root = calloc(1, sizeof(*root) + 1);
+    assert(root != NULL && "Buy more RAM");
+    atomic_init(&root->refs, 1);
+    root->src = strdup(root_src);
+    root->out = strdup(root_out);
+    root->fd = open(root->src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root->fd < 0){
+        fprintf(stderr, "[ERROR] Could not open directory '%s': %s\n", root->src, strerror(errno));
+        report->failed += 1;
+        dir_release(root);
+    }else{
+        atomic_store(&walk.unfinished, 1);
+        atomic_store(&walk.queued, 1);
+        deque_push(&walk.walkers[0].deque, root);
+    }
+
+    for (size_t i = 0; i < walk.walker_count; ++i){
+        pthread_create(&walk.walkers[i].thread, NULL, walker_thread, &walk.walkers[i]);
+    }
+    for (size_t i = 0; i < walk.walker_count; ++i){
+        Walker *walker = &walk.walkers[i];
+        pthread_join(walker->thread, NULL);
+        report->directories += walker->directories;
+        report->assets += walker->assets;
+        report->assets_unchanged += walker->assets_unchanged;
+        report->failed += walker->failed;
+        pthread_mutex_destroy(&walker->deque.lock);
+        free(walker->deque.items);
+    }
+    batch_finish(walk.batch, &report->batch);
+    check_links(&walk, root_out, &links, report);
+    bool site_ok = site_write(root_out, &pages, search, site);
+    for (size_t i = 0; i < walk.walker_count; ++i) da_free(walk.walkers[i].outputs);
+    batch_links_free(&links);
+    batch_pages_free(&pages);
+    search_index_destroy(search);
+    pthread_mutex_destroy(&walk.idle_lock);
+    pthread_cond_destroy(&walk.idle_cond);
+    free(walk.walkers);
+    return site_ok && report->failed == 0 && report->batch.failed == 0 && report->broken_links == 0;
+}
@@ -0,0 +1,26 @@
+#ifndef _BUILD_H
+#define _BUILD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "batch.h"
+#include "site.h"
+
+// `htmd build`: mirrors a source tree into an output directory, rendering
+// every .md file into an .html file and copying everything else.
+
+typedef struct{
+    size_t directories;
+    size_t assets;            // copied files
+    size_t assets_unchanged;  // of them, those already up to date (if_changed)
+    size_t failed;            // files and directories that couldn't be read, copied or created
+    size_t links;             // relative links in the rendered files
+    size_t broken_links;      // of them, those that don't lead to an output
+    Batch_Report batch;       // the rendered files
+} Build_Report;
+
+// `site` (optional) asks for files describing the site, see site.h.
+bool build_site(const char *src_dir, const char *out_dir, const Batch_Options *options, const Site_Options *site, Build_Report *report);
+
+#endif // _BUILD_H
@@ -0,0 +1,119 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <htmd.h>
+#include "internal.h"
+
+// Render cache
+//
+// The key space is split into stripes, each with its own lock and fragment
+// table (and a share of the byte budget), so threads only contend when they
+// hit the same stripe.
+
+#define CACHE_STRIPES 16
+
+// aligned to keep the locks of different stripes off each other's cache lines
+typedef struct{
+    _Alignas(64) pthread_mutex_t lock;
+    Fragment_Table table;
+    size_t hits;
+    size_t misses;
+} Cache_Stripe;
+
+struct Htmd_Cache{
+    Cache_Stripe stripes[CACHE_STRIPES];
+};
+
+// the stripe is chosen by the high half of the hash, the bucket by the low
+static Cache_Stripe* cache_stripe(Htmd_Cache *cache, Htmd_Hash key)
+{
+    return &cache->stripes[key.hi % CACHE_STRIPES];
+}
+
+Htmd_Cache* htmd_cache_create(size_t max_bytes)
+{
+    Htmd_Cache *cache = aligned_alloc(_Alignof(Htmd_Cache), sizeof(*cache));
+    if (cache == NULL) return NULL;
+    memset(cache, 0, sizeof(*cache));
+    for (size_t i = 0; i < CACHE_STRIPES; ++i) pthread_mutex_init(&cache->stripes[i].lock, NULL);
+    for (size_t i = 0; i < CACHE_STRIPES; ++i){
+        if (!fragment_table_init(&cache->stripes[i].table, max_bytes/CACHE_STRIPES)){
+            htmd_cache_destroy(cache);
+            return NULL;
+        }
+    }
+    return cache;
+}
+
+void htmd_cache_destroy(Htmd_Cache *cache)
+{
+    if (cache == NULL) return;
+    for (size_t i = 0; i < CACHE_STRIPES; ++i){
+        fragment_table_free(&cache->stripes[i].table);
+        pthread_mutex_destroy(&cache->stripes[i].lock);
+    }
+    free(cache);
+}
+
+const char* htmd_render_cached(Htmd_Cache *cache, Htmd_Context *ctx, const char *input, size_t len, size_t *size)
+{
+    if (!htmd_cacheable(ctx)) return htmd_render(ctx, input, len, size);
+    Htmd_Hash key = htmd_cache_key(ctx, input, len);
+    Cache_Stripe *stripe = cache_stripe(cache, key);
+
+    pthread_mutex_lock(&stripe->lock);
+    Fragment *hit = fragment_find(&stripe->table, key);
+    if (hit != NULL){
+        hit->referenced = true;
+        stripe->hits += 1;
+        // copied while locked, the entry may be evicted as soon as the lock is gone
+        htmd_render_copy(ctx, input, len, hit->data, hit->size);
+    }else{
+        stripe->misses += 1;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+
+    // the output is kept whole so it can be copied into the cache, and only
+    // then given to the writer
+    if (hit == NULL){
+        size_t html_size;
+        htmd_render_held(ctx, input, len);
+        if (htmd_stats(ctx)->out_of_memory){
+            if (size != NULL) *size = 0;
+            return NULL;
+        }
+        const char *html = htmd_output(ctx, &html_size);
+        Fragment *fragment = fragment_alloc(key, html_size);
+        if (fragment != NULL){
+            memcpy(fragment->data, html, html_size);
+            pthread_mutex_lock(&stripe->lock);
+            fragment_insert(&stripe->table, fragment);
+            pthread_mutex_unlock(&stripe->lock);
+        }
+    }
+    htmd_flush(ctx);
+    if (htmd_stats(ctx)->out_of_memory){
+        if (size != NULL) *size = 0;
+        return NULL;
+    }
+    return htmd_output(ctx, size);
+}
+
+Htmd_Cache_Stats htmd_cache_stats(Htmd_Cache *cache)
+{
+    Htmd_Cache_Stats stats = {0};
+    for (size_t i = 0; i < CACHE_STRIPES; ++i){
+        Cache_Stripe *stripe = &cache->stripes[i];
+        pthread_mutex_lock(&stripe->lock);
+        stats.hits += stripe->hits;
+        stats.misses += stripe->misses;
+        stats.insertions += stripe->table.insertions;
+        stats.evictions += stripe->table.evictions;
+        stats.entries += stripe->table.count;
+        stats.bytes += stripe->table.bytes;
+        pthread_mutex_unlock(&stripe->lock);
+    }
+    return stats;
+}
@@ -2,13 +2,22 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <htmd.h>
 #include <cwalk.h>
+#include "disk_cache.h"
+#include "batch.h"
+#include "build.h"
+#include "output.h"
+#include "template.h"
 
 #define NOB_IMPLEMENTATION
 #define NOB_STRIP_PREFIX
 #include <nob.h>
+#include "escape.h"
+
+#define eprintfn(msg, ...) do{fprintf(stderr, "[ERROR] " msg "\n", ##__VA_ARGS__);}while(0)
 
 static char exe_dir[FILENAME_MAX];
 static char temp_path[FILENAME_MAX];
@@ -68,15 +77,348 @@ char* read_file(const char *path)
     return content;
 }
 
+#define STDIN_CHUNK_SIZE (64*1024)
+
+void write_to_file(void *user, const char *data, size_t size)
+{
+    fwrite(data, 1, size, (FILE*) user);
+}
+
+#define IOV_BATCH 1024
+#define IOV_STAGING_SIZE (64*1024)
+#define IOV_MIN_REF_SIZE 512
+
+// Writes a rope with writev(). Long segments are passed to the kernel where
+// they are; short ones (tags, short text runs) are gathered into a staging
+// buffer first, since every iovec entry has a fixed cost of its own.
+bool write_rope(int fd, Htmd_Rope rope)
+{
+    static char staging[IOV_STAGING_SIZE];
+    struct iovec iov[IOV_BATCH];
+    size_t staged = 0;
+    size_t staged_from = 0;
+    int n = 0;
+    for (size_t i = 0; i < rope.count; ++i){
+        const Htmd_Segment *segment = &rope.items[i];
+        bool by_reference = segment->size >= IOV_MIN_REF_SIZE;
+        if (!by_reference && staged + segment->size <= sizeof(staging)){
+            memcpy(staging + staged, segment->data, segment->size);
+            staged += segment->size;
+            continue;
+        }
+        if (n + 2 > IOV_BATCH || !by_reference){
+            if (staged > staged_from) iov[n++] = (struct iovec) {staging + staged_from, staged - staged_from};
+            if (!writev_all(fd, iov, n)) return false;
+            n = 0;
+            staged = staged_from = 0;
+            if (!by_reference){
+                memcpy(staging, segment->data, segment->size);
+                staged = segment->size;
+                continue;
+            }
+        }
+        if (staged > staged_from) iov[n++] = (struct iovec) {staging + staged_from, staged - staged_from};
+        staged_from = staged;
+        iov[n++] = (struct iovec) {(void*) segment->data, segment->size};
+    }
+    if (staged > staged_from) iov[n++] = (struct iovec) {staging + staged_from, staged - staged_from};
+    return writev_all(fd, iov, n);
+}
+
+// the output of --if-changed is collected in a memory stream, which has no
+// descriptor to copy a cached file to
+bool append_fd(int fd, FILE *out)
+{
+    char buffer[64*1024];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0 || (n < 0 && errno == EINTR)){
+        if (n > 0) fwrite(buffer, 1, n, out);
+    }
+    return n == 0;
+}
+
+// renders a stream chunk by chunk, so the input never has to fit into memory
+bool render_stream(Htmd_Context *ctx, FILE *in)
+{
+    static char chunk[STDIN_CHUNK_SIZE];
+    htmd_begin(ctx);
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0){
+        htmd_feed(ctx, chunk, n);
+    }
+    bool ok = !ferror(in);
+    if (!ok) eprintfn("Could not read from input: %s!", strerror(errno));
+    if (!htmd_finish(ctx)){
+        eprintfn("Ran out of memory while rendering!");
+        ok = false;
+    }
+    return ok;
+}
+
+// the document head of -f (and -s), with the <title> and <meta> tags of the
+// front matter of the document rendered by `ctx`, if any
+void append_head(String_Builder *sb, bool do_styling, Htmd_Context *ctx)
+{
+    sb_append_cstr(sb, "<!DOCTYPE html>\n<html>\n<head>\n");
+    size_t meta_count = 0;
+    const Htmd_Meta *meta = ctx != NULL ? htmd_front_matter(ctx, &meta_count) : NULL;
+    for (size_t i = 0; i < meta_count; ++i){
+        // keys followed by a YAML list or map
+        if (meta[i].value_size == 0) continue;
+        if (meta[i].key_size == 5 && memcmp(meta[i].key, "title", 5) == 0){
+            sb_append_cstr(sb, "<title>");
+            sb_append_xml(sb, meta[i].value, meta[i].value_size);
+            sb_append_cstr(sb, "</title>\n");
+        }else{
+            sb_append_cstr(sb, "<meta name=\"");
+            sb_append_xml(sb, meta[i].key, meta[i].key_size);
+            sb_append_cstr(sb, "\" content=\"");
+            sb_append_xml(sb, meta[i].value, meta[i].value_size);
+            sb_append_cstr(sb, "\">\n");
+        }
+    }
+    if (do_styling){
+        cwk_path_join(exe_dir, "src/head.html", temp_path, sizeof(temp_path));
+        read_entire_file(temp_path, sb);
+        sb_append_cstr(sb, "<style>\n");
+
+        cwk_path_join(exe_dir, "src/style.css", temp_path, sizeof(temp_path));
+        read_entire_file(temp_path, sb);
+        sb_append_cstr(sb, "</style>\n");
+    }
+    sb_append_cstr(sb, "</head>\n<body>\n");
+}
+
+// the title of a page whose front matter has none
+typedef struct{
+    char text[256];
+    size_t size;
+    bool found;
+} First_Heading;
+
+void remember_first_heading(void *user, size_t level, const char *id, size_t id_size, const char *text, size_t text_size)
+{
+    (void) level; (void) id; (void) id_size;
+    First_Heading *heading = user;
+    if (heading->found) return;
+    heading->found = true;
+    heading->size = text_size < sizeof(heading->text) ? text_size : sizeof(heading->text);
+    memcpy(heading->text, text, heading->size);
+}
+
+// -f: the head, which needs the front matter, followed by `html`, or the
+// template filled with them
+void append_full_html(String_Builder *sb, bool do_styling, const Template *template, const First_Heading *heading,
+                      Htmd_Context *ctx, const char *html, size_t size)
+{
+    if (template == NULL){
+        append_head(sb, do_styling, ctx);
+        sb_append_buf(sb, html, size);
+        return;
+    }
+    char title[6*sizeof(heading->text)];
+    Template_Values values = {.title = title, .content = html, .content_size = size};
+    size_t title_size;
+    const char *text = htmd_meta(ctx, "title", &title_size);
+    if (text == NULL){
+        text = heading->text;
+        title_size = heading->size;
+    }
+    values.title_size = template_escape(text, title_size, title, sizeof(title));
+    if (template->has[Template_Toc]) values.toc = htmd_toc(ctx, &values.toc_size);
+    struct iovec *iov = malloc(template->count*sizeof(*iov));
+    assert(iov != NULL && "Buy more RAM");
+    template_fill(template, &values, iov);
+    for (size_t i = 0; i < template->count; ++i) sb_append_buf(sb, iov[i].iov_base, iov[i].iov_len);
+    free(iov);
+}
+
+// -f with the HTML held back by `ctx`
+void write_full_html(FILE *out, String_Builder *sb, bool do_styling, const Template *template, const First_Heading *heading, Htmd_Context *ctx)
+{
+    size_t size;
+    const char *html = htmd_output(ctx, &size);
+    append_full_html(sb, do_styling, template, heading, ctx, html, size);
+    fwrite(sb->items, 1, sb->count, out);
+}
+
+// foo/bar.md -> <out_dir>/foo/bar.html (or .txt)
+void batch_output_path(const char *input, const char *out_dir, const char *extension, char *buffer, size_t size)
+{
+    cwk_path_change_extension(input, extension, buffer, size);
+    if (out_dir == NULL) return;
+    char html[FILENAME_MAX];
+    size_t root;
+    strncpy(html, buffer, sizeof(html) - 1);
+    html[sizeof(html) - 1] = '\0';
+    cwk_path_get_root(html, &root);
+    cwk_path_join(out_dir, html + root, buffer, size);
+}
+
+// Creates the directories leading up to `path`. `made` remembers the last
+// one, so the files of a directory only pay for it once.
+bool make_parent_dirs(const char *path, String_Builder *made)
+{
+    size_t dir_len;
+    cwk_path_get_dirname(path, &dir_len);
+    if (dir_len == 0) return true;
+    if (made->count == dir_len && memcmp(made->items, path, dir_len) == 0) return true;
+    char dir[FILENAME_MAX];
+    if (dir_len >= sizeof(dir)){
+        eprintfn("The directory of '%s' has too long a path!", path);
+        return false;
+    }
+    memcpy(dir, path, dir_len);
+    dir[dir_len] = '\0';
+    for (char *pr = dir + 1; *pr != '\0'; ++pr){
+        if (*pr != '/') continue;
+        *pr = '\0';
+        if (!mkdir_if_not_exists(dir)) return false;
+        *pr = '/';
+    }
+    made->count = 0;
+    sb_append_buf(made, path, dir_len);
+    return true;
+}
+
+// adds `input` to the batch, false when there is no place for its output
+bool add_batch_file(Batch *batch, const char *input, const char *out_dir, const char *extension, String_Builder *made)
+{
+    char output[FILENAME_MAX];
+    batch_output_path(input, out_dir, extension, output, sizeof(output));
+    if (!make_parent_dirs(output, made)) return false;
+    batch_add(batch, input, output);
+    return true;
+}
+
+void print_batch_report(const Batch_Report *report, uint64_t started)
+{
+    double seconds = (nanos_since_unspecified_epoch() - started)/1e9;
+    size_t files = report->files + report->failed;
+    fprintf(stderr, "files:        %zu rendered (%zu unchanged), %zu failed in %.3f s\n", report->files, report->unchanged, report->failed, seconds);
+    fprintf(stderr, "bytes:        %zu in, %zu out\n", report->input_bytes, report->output_bytes);
+    fprintf(stderr, "io:           %s, %zu syscalls (%.2f per file)\n", report->uring ? "io_uring" : "blocking",
+            report->syscalls, files > 0 ? (double) report->syscalls/files : 0.0);
+}
+
+// --batch: every input becomes an .html file next to it, or in the same place under --out-dir
+int run_batch(const char **inputs, size_t count, const char *out_dir, Batch_Options *options, bool stats)
+{
+    uint64_t started = nanos_since_unspecified_epoch();
+    const char *extension = options->format == Htmd_Format_Text ? ".txt" : ".html";
+    String_Builder made = {0};
+    size_t skipped = 0;
+    Batch *batch = batch_start(options);
+    if (batch == NULL){
+        eprintfn("Could not start the batch!");
+        return 1;
+    }
+    for (size_t i = 0; i < count; ++i){
+        if (strcmp(inputs[i], "-") != 0){
+            if (!add_batch_file(batch, inputs[i], out_dir, extension, &made)) skipped += 1;
+            continue;
+        }
+        // paths from stdin, one per line
+        char line[FILENAME_MAX];
+        while (fgets(line, sizeof(line), stdin) != NULL){
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] != '\0' && !add_batch_file(batch, line, out_dir, extension, &made)) skipped += 1;
+        }
+    }
+    Batch_Report report;
+    batch_finish(batch, &report);
+    report.failed += skipped;
+    sb_free(made);
+
+    if (stats) print_batch_report(&report, started);
+    return report.failed > 0 ? 1 : 0;
+}
+
+// htmd build <src_dir> <out_dir>
+int run_build(const char *src_dir, const char *out_dir, Batch_Options *options, const Site_Options *site, bool stats)
+{
+    uint64_t started = nanos_since_unspecified_epoch();
+    Build_Report report;
+    bool ok = build_site(src_dir, out_dir, options, site, &report);
+    if (stats){
+        print_batch_report(&report.batch, started);
+        fprintf(stderr, "assets:       %zu copied (%zu unchanged), %zu directories, %zu failed\n", report.assets, report.assets_unchanged, report.directories, report.failed);
+        fprintf(stderr, "links:        %zu checked, %zu broken\n", report.links, report.broken_links);
+    }
+    return ok ? 0 : 1;
+}
+
+#define DEFAULT_CACHE_SIZE (256*1024*1024)
+#define LINKS_MEMORY (1024*1024)
+
+// `disk_cache` is "hit", "miss" or NULL when the cache isn't used
+void print_stats(const Htmd_Stats *stats, const Htmd_Alloc_Counter *alloc, const char *disk_cache, bool json)
+{
+    if (json){
+        fprintf(stderr, "{");
+        if (disk_cache != NULL) fprintf(stderr, "\"disk_cache\": \"%s\", ", disk_cache);
+        fprintf(stderr, "\"input_bytes\": %zu, \"output_bytes\": %zu, \"lines\": %zu, ",
+                stats->input_bytes, stats->output_bytes, stats->lines);
+        fprintf(stderr, "\"blocks\": {\"headings\": %zu, \"paragraphs\": %zu, \"lists\": %zu, \"code_blocks\": %zu, \"blockquotes\": %zu, \"rules\": %zu}, ",
+                stats->headings, stats->paragraphs, stats->lists, stats->code_blocks, stats->blockquotes, stats->rules);
+        fprintf(stderr, "\"inline\": {\"strong\": %zu, \"emphasis\": %zu, \"code_spans\": %zu, \"strikethroughs\": %zu, \"links\": %zu, \"images\": %zu, \"checkboxes\": %zu}, ",
+                stats->strong, stats->emphasis, stats->code_spans, stats->strikethroughs, stats->links, stats->images, stats->checkboxes);
+        fprintf(stderr, "\"alloc\": {\"allocations\": %zu, \"frees\": %zu, \"bytes_requested\": %zu, \"bytes_copied\": %zu, \"high_water\": %zu}, ",
+                alloc->allocations, alloc->frees, alloc->bytes_requested, alloc->bytes_copied, alloc->high_water);
+        fprintf(stderr, "\"block_cache\": {\"hits\": %zu, \"misses\": %zu}, ",
+                stats->block_cache_hits, stats->block_cache_misses);
+        fprintf(stderr, "\"block_ns\": %llu, \"inline_ns\": %llu, \"peak_output_size\": %zu}\n",
+                (unsigned long long) stats->block_nanos, (unsigned long long) stats->inline_nanos, stats->peak_output_size);
+        return;
+    }
+    if (disk_cache != NULL) fprintf(stderr, "disk cache:   %s\n", disk_cache);
+    fprintf(stderr, "input:        %zu bytes, %zu lines\n", stats->input_bytes, stats->lines);
+    fprintf(stderr, "output:       %zu bytes (peak buffer %zu bytes)\n", stats->output_bytes, stats->peak_output_size);
+    fprintf(stderr, "blocks:       %zu headings, %zu paragraphs, %zu lists, %zu code blocks, %zu blockquotes, %zu rules\n",
+            stats->headings, stats->paragraphs, stats->lists, stats->code_blocks, stats->blockquotes, stats->rules);
+    fprintf(stderr, "inline:       %zu strong, %zu emphasis, %zu code spans, %zu strikethroughs, %zu links, %zu images, %zu checkboxes\n",
+            stats->strong, stats->emphasis, stats->code_spans, stats->strikethroughs, stats->links, stats->images, stats->checkboxes);
+    fprintf(stderr, "allocations:  %zu (%zu frees), %zu bytes requested, %zu bytes copied by realloc, high-water %zu bytes\n",
+            alloc->allocations, alloc->frees, alloc->bytes_requested, alloc->bytes_copied, alloc->high_water);
+    if (stats->block_cache_hits + stats->block_cache_misses > 0){
+        fprintf(stderr, "block cache:  %zu hits, %zu misses\n", stats->block_cache_hits, stats->block_cache_misses);
+    }
+    fprintf(stderr, "block parse:  %.3f ms\n", stats->block_nanos/1e6);
+    fprintf(stderr, "inline:       %.3f ms\n", stats->inline_nanos/1e6);
+}
+
 void print_usage(const char *program_name)
 {
-    printf("Usage: %s [OPTIONS] <input_file>\n\n", program_name);
+    printf("Usage: %s [OPTIONS] <input_file>\n", program_name);
+    printf("       %s build [OPTIONS] <src_dir> <out_dir>\n\n", program_name);
 
     printf("Options:\n");
     printf("  -f                   : create a full html\n");
     printf("  -s                   : add styling to output (only together with -f)\n");
+    printf("  --template <file>    : -f with the page made from <file>, in which {{title}}, {{content}}\n");
+    printf("                         and {{toc}} are filled in\n");
     printf("  --file <output_file> : write the output to a file\n");
+    printf("  --stats[=json]       : print render statistics to stderr\n");
+    printf("  --rope               : reference the input in the output and write it with writev()\n");
+    printf("  --cache <dir>        : reuse the output of earlier runs on unchanged files, kept in <dir>\n");
+    printf("  --cache-size <bytes> : limit the size of the cache (default 256 MiB)\n");
+    printf("  --md-links           : point relative links to .md files at their .html (always on in build)\n");
+    printf("  --heading-ids        : give headings ids made from their text (always on in build)\n");
+    printf("  --toc                : put a table of contents at a [TOC] line, or at the top\n");
+    printf("  --text               : output plain text instead of HTML (.txt files with --batch)\n");
+    printf("  --text-urls          : --text: follow links by their target in parentheses\n");
+    printf("  --text-code          : --text: keep code spans and blocks\n");
+    printf("  --if-changed         : only replace output files whose content changes\n");
+    printf("  --batch              : render every <input_file> into an .html file next to it\n");
+    printf("  --out-dir <dir>      : put the files of --batch under <dir> instead\n");
+    printf("  --io <mode>          : I/O of --batch and build: auto (default), uring or blocking\n");
+    printf("  -j <threads>         : render threads of --batch and build (default: one per CPU)\n");
+    printf("  --site-url <url>     : build: write sitemap.xml and feed.xml for the site served at <url>\n");
+    printf("  --search-index       : build: write search.json with the title and text of every page and\n");
+    printf("                         search-index.json with the pages of every word\n");
     printf("  -h / --help          : print this help message\n\n");
+    printf("Use '-' as <input_file> to read from stdin, with --batch to read a list of files from stdin.\n");
+    printf("build renders every .md file of <src_dir> into the same place under <out_dir> and copies the other files.\n\n");
 }
 
 int main(int argc, char *argv[])
@@ -92,6 +434,28 @@ int main(int argc, char *argv[])
     bool do_styling = false;
     const char *output_file = NULL;
     const char *input_file = NULL;
+    bool stats = false;
+    bool stats_json = false;
+    bool use_rope = false;
+    const char *cache_dir = NULL;
+    size_t cache_size = DEFAULT_CACHE_SIZE;
+    bool batch = false;
+    const char *out_dir = NULL;
+    Batch_Options batch_options = {0};
+    Site_Options site_options = {0};
+    const char *template_path = NULL;
+    Template template = {0};
+    const Template *page_template = NULL;
+    First_Heading first_heading = {0};
+    File_Paths inputs = {0};
+    bool build = argc > 0 && strcmp(argv[0], "build") == 0;
+    if (build){
+        shift_args(&argc, &argv);
+        // links between the pages of a site have to lead to their HTML,
+        // and to headings that are there
+        batch_options.md_links = true;
+        batch_options.heading_ids = true;
+    }
 
     while (argc > 0){
         const char *arg = shift_args(&argc, &argv);
@@ -99,15 +463,59 @@ int main(int argc, char *argv[])
             full_html = true;
         }else if (strcmp(arg, "-s") == 0){
             do_styling = true;
+        }else if (strcmp(arg, "--template") == 0 && argc > 0){
+            template_path = shift_args(&argc, &argv);
+            full_html = true;
         }else if (strcmp(arg, "--file") == 0){
             output_file = shift_args(&argc, &argv);
+        }else if (strcmp(arg, "--cache") == 0 && argc > 0){
+            cache_dir = shift_args(&argc, &argv);
+        }else if (strcmp(arg, "--cache-size") == 0 && argc > 0){
+            cache_size = strtoull(shift_args(&argc, &argv), NULL, 10);
+        }else if (strcmp(arg, "--md-links") == 0){
+            batch_options.md_links = true;
+        }else if (strcmp(arg, "--heading-ids") == 0){
+            batch_options.heading_ids = true;
+        }else if (strcmp(arg, "--toc") == 0){
+            batch_options.toc = true;
+        }else if (strcmp(arg, "--text") == 0){
+            batch_options.format = Htmd_Format_Text;
+        }else if (strcmp(arg, "--text-urls") == 0){
+            batch_options.text_link_urls = true;
+        }else if (strcmp(arg, "--text-code") == 0){
+            batch_options.text_code = true;
+        }else if (strcmp(arg, "--if-changed") == 0){
+            batch_options.if_changed = true;
+        }else if (strcmp(arg, "--batch") == 0){
+            batch = true;
+        }else if (strcmp(arg, "--out-dir") == 0 && argc > 0){
+            out_dir = shift_args(&argc, &argv);
+        }else if (strcmp(arg, "--io") == 0 && argc > 0){
+            const char *mode = shift_args(&argc, &argv);
+            if (strcmp(mode, "uring") == 0) batch_options.io = Batch_Io_Uring;
+            else if (strcmp(mode, "blocking") == 0) batch_options.io = Batch_Io_Blocking;
+            else batch_options.io = Batch_Io_Auto;
+        }else if (strcmp(arg, "--site-url") == 0 && argc > 0){
+            site_options.url = shift_args(&argc, &argv);
+        }else if (strcmp(arg, "--search-index") == 0){
+            site_options.search_index = true;
+        }else if (strcmp(arg, "-j") == 0 && argc > 0){
+            batch_options.threads = strtoul(shift_args(&argc, &argv), NULL, 10);
+        }else if (strcmp(arg, "--rope") == 0){
+            use_rope = true;
+        }else if (strcmp(arg, "--stats") == 0){
+            stats = true;
+        }else if (strcmp(arg, "--stats=json") == 0){
+            stats = true;
+            stats_json = true;
         }else if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0){
             print_usage(program_name);
             return 0;
         }else{
+            da_append(&inputs, arg);
             if (input_file == NULL){
                 input_file = arg;
-            }else{
+            }else if (!batch && !build){
                 eprintfn("Invalid argument '%s'!", arg);
                 print_usage(program_name);
                 return 1;
@@ -119,42 +527,215 @@ int main(int argc, char *argv[])
         print_usage(program_name);
         return 1;
     }
+    if (batch_options.format == Htmd_Format_Text && (build || full_html)){
+        eprintfn("--text can't be used with %s!", build ? "build" : "-f");
+        return 1;
+    }
+    if (template_path != NULL){
+        if (!template_load(&template, template_path)) return 1;
+        page_template = &template;
+    }
     int result = 0;
-
     String_Builder sb = {0};
-    
-    char *content = read_file(input_file);
-    if (full_html){
-        sb_append_cstr(&sb, "<!DOCTYPE html>\n<html>\n<head>\n");
-        if (do_styling){
-            cwk_path_join(exe_dir, "src/head.html", temp_path, sizeof(temp_path));
-            read_entire_file(temp_path, &sb);
-            sb_append_cstr(&sb, "<style>\n");
-
-            cwk_path_join(exe_dir, "src/style.css", temp_path, sizeof(temp_path));
-            read_entire_file(temp_path, &sb);
-            sb_append_cstr(&sb, "</style>\n");
-        }
-        sb_append_cstr(&sb, "</head>\n<body>\n");
-    }
-    char *output = render_markdown(content);
-    if (output != NULL){
-        sb_append_cstr(&sb, output);
-    }
-    if (full_html) sb_append_cstr(&sb, "</body>\n</html>");
-    if (output_file != NULL){
-        FILE *file = fopen(output_file, "w");
-        if (file == NULL){
+    // mkdir_if_not_exists() and copy_file() would log every file
+    if (batch || build) minimal_log_level = WARNING;
+    if ((batch || build) && page_template != NULL){
+        batch_options.template = page_template;
+    }else if ((batch || build) && full_html){
+        append_head(&sb, do_styling, NULL);
+        batch_options.prefix = sb.items;
+        batch_options.prefix_size = sb.count;
+        batch_options.suffix = "</body>\n</html>";
+        batch_options.suffix_size = strlen(batch_options.suffix);
+    }
+    if (build){
+        if (inputs.count != 2){
+            eprintfn("build needs a source and an output directory!");
+            print_usage(program_name);
+            return 1;
+        }
+        site_options.if_changed = batch_options.if_changed;
+        result = run_build(inputs.items[0], inputs.items[1], &batch_options, &site_options, stats);
+        template_free(&template);
+        sb_free(sb);
+        da_free(inputs);
+        return result;
+    }
+    if (batch){
+        result = run_batch(inputs.items, inputs.count, out_dir, &batch_options, stats);
+        template_free(&template);
+        sb_free(sb);
+        da_free(inputs);
+        return result;
+    }
+    da_free(inputs);
+
+    bool from_stdin = strcmp(input_file, "-") == 0;
+    char *content = NULL;
+    FILE *out = stdout;
+    Htmd_Context *ctx = NULL;
+    Disk_Cache cache = {.dir_fd = -1, .index_fd = -1};
+    bool use_cache = cache_dir != NULL && !from_stdin;
+    struct stat input_stat;
+    char input_path[PATH_MAX];
+    Htmd_Hash content_hash = {0};
+    int cached_fd = -1;
+    // the options that change the HTML, each a bit
+    uint64_t cache_variant = (batch_options.md_links ? 1 : 0) | (batch_options.heading_ids ? 2 : 0) | (batch_options.toc ? 4 : 0) |
+                             (batch_options.format == Htmd_Format_Text ? 8 : 0) | (batch_options.text_link_urls ? 16 : 0) | (batch_options.text_code ? 32 : 0) |
+                             (full_html ? 64 : 0) | (full_html && do_styling ? 128 : 0);
+    // a template changes the page as much as its text does
+    if (page_template != NULL) cache_variant |= htmd_hash(template.source, template.size).lo << 8;
+    Htmd_Links *links = NULL;
+    bool if_changed = output_file != NULL && batch_options.if_changed;
+    char *pending = NULL;
+    size_t pending_size = 0;
+
+    // a hit on the metadata of the input doesn't even read it
+    if (use_cache){
+        if (realpath(input_file, input_path) == NULL || stat(input_path, &input_stat) < 0){
+            eprintfn("Could not read stats from '%s': %s!", input_file, strerror(errno));
+            return_defer(1);
+        }
+        if (disk_cache_open(&cache, cache_dir, cache_size)){
+            cached_fd = disk_cache_find(&cache, input_path, cache_variant, &input_stat, NULL);
+        }else{
+            fprintf(stderr, "[WARNING] Could not open cache '%s': %s, rendering without it\n", cache_dir, strerror(errno));
+            use_cache = false;
+        }
+    }
+    if (!from_stdin && cached_fd < 0){
+        content = read_file(input_file);
+        if (content == NULL) return_defer(1);
+        if (use_cache){
+            content_hash = htmd_hash(content, strlen(content));
+            cached_fd = disk_cache_find(&cache, input_path, cache_variant, &input_stat, &content_hash);
+        }
+    }
+    if (if_changed){
+        out = open_memstream(&pending, &pending_size);
+        if (out == NULL){
+            eprintfn("Could not buffer the output: %s", strerror(errno));
+            out = stdout;
+            return_defer(1);
+        }
+    }else if (output_file != NULL){
+        out = fopen(output_file, "w");
+        if (out == NULL){
             eprintfn("Could not open output file '%s': %s", output_file, strerror(errno));
+            out = stdout;
             return_defer(1);
         }
-        fwrite(sb.items, 1, sb.count, file);
-        fclose(file);
-    }else if (sb.items != NULL) {
-         puts(sb.items);
+    }
+    Htmd_Alloc_Counter alloc_counter = {0};
+    Htmd_Allocator counting_allocator = htmd_counting_allocator(&alloc_counter);
+    Htmd_Options options = {
+        .write = write_to_file,
+        .user = out,
+        .collect_stats = stats,
+        .heading_ids = batch_options.heading_ids,
+        .toc = batch_options.toc,
+        .format = batch_options.format,
+        .text_link_urls = batch_options.text_link_urls,
+        .text_code = batch_options.text_code,
+    };
+    if (batch_options.md_links){
+        links = htmd_links_create(LINKS_MEMORY);
+        htmd_links_set_document(links, from_stdin ? "" : input_file);
+        options.link = htmd_links_rewrite;
+        options.link_user = links;
+    }
+    // the cache needs the whole output at once, and the head of -f the front
+    // matter, which is only known once the document is rendered
+    if (use_cache || full_html) options.write = NULL;
+    if (page_template != NULL && page_template->has[Template_Title]){
+        options.heading = remember_first_heading;
+        options.heading_user = &first_heading;
+    }
+    if (page_template != NULL) options.toc_apart = page_template->has[Template_Toc];
+    if (stats) options.allocator = &counting_allocator;
+    ctx = htmd_create(&options);
+    if (ctx == NULL){
+        eprintfn("Could not create render context!");
+        return_defer(1);
+    }
+    if (from_stdin){
+        if (!render_stream(ctx, stdin)) result = 1;
+        if (full_html) write_full_html(out, &sb, do_styling, page_template, &first_heading, ctx);
+    }else if (cached_fd >= 0){
+        struct stat html_stat;
+        fflush(out);
+        bool copied = if_changed ? append_fd(cached_fd, out)
+                    : fstat(cached_fd, &html_stat) == 0 && copy_fd(cached_fd, fileno(out), html_stat.st_size);
+        if (!copied){
+            eprintfn("Could not copy the cached output: %s", strerror(errno));
+            return_defer(1);
+        }
+    }else if (use_cache){
+        size_t size;
+        const char *html = htmd_render(ctx, content, strlen(content), &size);
+        if (html == NULL){
+            eprintfn("Ran out of memory while rendering!");
+            return_defer(1);
+        }
+        // with -f the head is cached along with the body
+        if (full_html){
+            append_full_html(&sb, do_styling, page_template, &first_heading, ctx, html, size);
+            html = sb.items;
+            size = sb.count;
+        }
+        fwrite(html, 1, size, out);
+        if (!disk_cache_store(&cache, input_path, cache_variant, &input_stat, content_hash, html, size)){
+            fprintf(stderr, "[WARNING] Could not store the output in the cache: %s\n", strerror(errno));
+        }
+    }else if (use_rope && !if_changed && page_template == NULL){
+        // the whole file is in memory already, so the output can point into it
+        Htmd_Rope rope = htmd_render_rope(ctx, content, strlen(content));
+        if (htmd_stats(ctx)->out_of_memory){
+            eprintfn("Ran out of memory while rendering!");
+            return_defer(1);
+        }
+        if (full_html){
+            append_head(&sb, do_styling, ctx);
+            fwrite(sb.items, 1, sb.count, out);
+        }
+        fflush(out);
+        if (!write_rope(fileno(out), rope)){
+            eprintfn("Could not write output: %s", strerror(errno));
+            return_defer(1);
+        }
+    }else{
+        htmd_begin(ctx);
+        htmd_feed(ctx, content, strlen(content));
+        if (!htmd_finish(ctx)){
+            eprintfn("Ran out of memory while rendering!");
+            return_defer(1);
+        }
+        if (full_html) write_full_html(out, &sb, do_styling, page_template, &first_heading, ctx);
+    }
+    if (stats){
+        const char *disk_cache = use_cache ? (cached_fd >= 0 ? "hit" : "miss") : NULL;
+        print_stats(htmd_stats(ctx), &alloc_counter, disk_cache, stats_json);
+    }
+    if (full_html && page_template == NULL) fputs("</body>\n</html>", out);
+    if (out == stdout) fputc('\n', out);
+    if (if_changed){
+        fclose(out);
+        out = stdout;
+        struct iovec iov = {pending, pending_size};
+        Write_Result written = write_if_changed(output_file, &iov, 1, 0644, NULL);
+        if (written == Write_Failed) result = 1;
+        if (stats && !stats_json) fprintf(stderr, "output file:  %s\n", written == Write_Unchanged ? "unchanged" : "written");
     }
   defer:
+    if (cached_fd >= 0) close(cached_fd);
+    disk_cache_close(&cache);
+    htmd_destroy(ctx);
+    htmd_links_destroy(links);
+    if (out != stdout) fclose(out);
     free(content);
+    free(pending);
+    template_free(&template);
     sb_free(sb);
     return result;
 }
@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+
+#include "disk_cache.h"
+
+// The index is a fixed size hash table of slots, addressed by the hash of the
+// input path. A lookup probes DISK_CACHE_PROBE neighbouring slots, so it
+// touches a single page of the mapping. Every run holds an flock() on the
+// index only while reading or changing it.
+//
+// The header records the size and mtime of the htmd binary that created the
+// cache: a rebuilt htmd may render differently, so it starts over.
+
+#define DISK_CACHE_MAGIC 0x3158444e49444d48ull // "HMDINDX1"
+#define DISK_CACHE_SLOTS 4096
+#define DISK_CACHE_PROBE 8
+#define DISK_CACHE_INDEX "index"
+
+typedef struct{
+    uint64_t magic;
+    uint64_t exe_size;
+    int64_t exe_mtime;
+    uint64_t clock;      // advanced by every access, orders the slots for LRU
+    uint64_t bytes;      // size of all cached HTML
+} Index_Header;
+
+typedef struct{
+    Htmd_Hash path;      // zero: empty
+    Htmd_Hash content;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;   // zero: only the content hash identifies the input
+    int64_t mtime_nsec;
+    uint64_t html_size;
+    uint64_t last_used;
+} Index_Slot;
+
+typedef struct{
+    Index_Header header;
+    Index_Slot slots[DISK_CACHE_SLOTS];
+} Index;
+
+void html_file_name(Htmd_Hash path, char *name, size_t size)
+{
+    snprintf(name, size, "%016llx%016llx.html", (unsigned long long) path.hi, (unsigned long long) path.lo);
+}
+
+bool slot_is_empty(const Index_Slot *slot)
+{
+    return slot->path.lo == 0 && slot->path.hi == 0;
+}
+
+void drop_slot(Disk_Cache *cache, Index_Slot *slot)
+{
+    Index *index = cache->index;
+    char name[64];
+    html_file_name(slot->path, name, sizeof(name));
+    unlinkat(cache->dir_fd, name, 0);
+    index->header.bytes -= slot->html_size;
+    *slot = (Index_Slot) {0};
+}
+
+// the slot of `path`, or where it would go; evicts the least recently used
+// slot of the probe window when that is full
+Index_Slot* probe_slot(Disk_Cache *cache, Htmd_Hash path, bool claim)
+{
+    Index *index = cache->index;
+    Index_Slot *free_slot = NULL;
+    Index_Slot *oldest = NULL;
+    for (size_t i = 0; i < DISK_CACHE_PROBE; ++i){
+        Index_Slot *slot = &index->slots[(path.lo + i) % DISK_CACHE_SLOTS];
+        if (slot->path.lo == path.lo && slot->path.hi == path.hi) return slot;
+        if (slot_is_empty(slot)){
+            if (free_slot == NULL) free_slot = slot;
+        }else if (oldest == NULL || slot->last_used < oldest->last_used){
+            oldest = slot;
+        }
+    }
+    if (!claim) return NULL;
+    if (free_slot != NULL) return free_slot;
+    drop_slot(cache, oldest);
+    return oldest;
+}
+
+void evict_to_fit(Disk_Cache *cache, Index_Slot *keep)
+{
+    Index *index = cache->index;
+    while (index->header.bytes > cache->max_bytes){
+        Index_Slot *oldest = NULL;
+        for (size_t i = 0; i < DISK_CACHE_SLOTS; ++i){
+            Index_Slot *slot = &index->slots[i];
+            if (slot == keep || slot_is_empty(slot)) continue;
+            if (oldest == NULL || slot->last_used < oldest->last_used) oldest = slot;
+        }
+        if (oldest == NULL) break;
+        drop_slot(cache, oldest);
+    }
+}
+
+void reset_index(Disk_Cache *cache, const struct stat *exe)
+{
+    Index *index = cache->index;
+    if (index->header.magic == DISK_CACHE_MAGIC){
+        for (size_t i = 0; i < DISK_CACHE_SLOTS; ++i){
+            if (!slot_is_empty(&index->slots[i])) drop_slot(cache, &index->slots[i]);
+        }
+    }
+    memset(index, 0, sizeof(*index));
+    index->header.magic = DISK_CACHE_MAGIC;
+    index->header.exe_size = exe->st_size;
+    index->header.exe_mtime = exe->st_mtime;
+}
+
+bool disk_cache_open(Disk_Cache *cache, const char *dir, size_t max_bytes)
+{
+    *cache = (Disk_Cache) {.dir_fd = -1, .index_fd = -1, .max_bytes = max_bytes};
+    struct stat exe;
+    if (stat("/proc/self/exe", &exe) < 0) return false;
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) return false;
+    cache->dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cache->dir_fd < 0) goto fail;
+    cache->index_fd = openat(cache->dir_fd, DISK_CACHE_INDEX, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (cache->index_fd < 0) goto fail;
+
+    cache->index_size = sizeof(Index);
+    if (flock(cache->index_fd, LOCK_EX) < 0) goto fail;
+    struct stat st;
+    if (fstat(cache->index_fd, &st) < 0 || ((size_t) st.st_size != cache->index_size && ftruncate(cache->index_fd, cache->index_size) < 0)){
+        flock(cache->index_fd, LOCK_UN);
+        goto fail;
+    }
+    cache->index = mmap(NULL, cache->index_size, PROT_READ | PROT_WRITE, MAP_SHARED, cache->index_fd, 0);
+    if (cache->index == MAP_FAILED){
+        cache->index = NULL;
+        flock(cache->index_fd, LOCK_UN);
+        goto fail;
+    }
+    Index_Header *header = &((Index*) cache->index)->header;
+    if (header->magic != DISK_CACHE_MAGIC || header->exe_size != (uint64_t) exe.st_size || header->exe_mtime != exe.st_mtime){
+        reset_index(cache, &exe);
+    }
+    flock(cache->index_fd, LOCK_UN);
+    return true;
+
+  fail:
+    disk_cache_close(cache);
+    return false;
+}
+
+void disk_cache_close(Disk_Cache *cache)
+{
+    if (cache->index != NULL) munmap(cache->index, cache->index_size);
+    if (cache->index_fd >= 0) close(cache->index_fd);
+    if (cache->dir_fd >= 0) close(cache->dir_fd);
+    *cache = (Disk_Cache) {.dir_fd = -1, .index_fd = -1};
+}
+
+bool metadata_matches(const Index_Slot *slot, const struct stat *st)
+{
+    return slot->mtime_sec != 0
+        && slot->dev == (uint64_t) st->st_dev && slot->ino == (uint64_t) st->st_ino
+        && slot->size == (uint64_t) st->st_size
+        && slot->mtime_sec == st->st_mtim.tv_sec && slot->mtime_nsec == st->st_mtim.tv_nsec;
+}
+
+// Metadata is only recorded for files that weren't modified in the last
+// second: a file can change again within its mtime's granularity, and its
+// metadata would then still match the old content.
+void set_metadata(Index_Slot *slot, const struct stat *st)
+{
+    slot->dev = st->st_dev;
+    slot->ino = st->st_ino;
+    slot->size = st->st_size;
+    slot->mtime_sec = 0;
+    slot->mtime_nsec = 0;
+    if (st->st_mtim.tv_sec < time(NULL) - 1){
+        slot->mtime_sec = st->st_mtim.tv_sec;
+        slot->mtime_nsec = st->st_mtim.tv_nsec;
+    }
+}
+
+Htmd_Hash entry_key(const char *path, uint64_t variant)
+{
+    Htmd_Hash key = htmd_hash(path, strlen(path));
+    key.hi ^= variant*0x9E3779B97F4A7C15ull;
+    return key;
+}
+
+int disk_cache_find(Disk_Cache *cache, const char *path, uint64_t variant, const struct stat *st, const Htmd_Hash *content)
+{
+    Index *index = cache->index;
+    Htmd_Hash key = entry_key(path, variant);
+    int fd = -1;
+    flock(cache->index_fd, LOCK_EX);
+    Index_Slot *slot = probe_slot(cache, key, false);
+    bool hit = slot != NULL && (content != NULL
+        ? slot->content.lo == content->lo && slot->content.hi == content->hi
+        : metadata_matches(slot, st));
+    if (hit){
+        char name[64];
+        html_file_name(key, name, sizeof(name));
+        fd = openat(cache->dir_fd, name, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0){
+            slot->last_used = ++index->header.clock;
+            if (content != NULL) set_metadata(slot, st);
+        }
+    }
+    flock(cache->index_fd, LOCK_UN);
+    return fd;
+}
+
+bool disk_cache_store(Disk_Cache *cache, const char *path, uint64_t variant, const struct stat *st, Htmd_Hash content, const char *html, size_t size)
+{
+    Index *index = cache->index;
+    Htmd_Hash key = entry_key(path, variant);
+    char name[64], temp[96];
+    html_file_name(key, name, sizeof(name));
+    snprintf(temp, sizeof(temp), "%s.%d", name, (int) getpid());
+
+    // written next to its final name and renamed, so readers never see half a file
+    int fd = openat(cache->dir_fd, temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    size_t written = 0;
+    while (written < size){
+        ssize_t n = write(fd, html + written, size - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        written += n;
+    }
+    close(fd);
+    if (written < size){
+        unlinkat(cache->dir_fd, temp, 0);
+        return false;
+    }
+
+    flock(cache->index_fd, LOCK_EX);
+    Index_Slot *slot = probe_slot(cache, key, true);
+    bool ok = renameat(cache->dir_fd, temp, cache->dir_fd, name) == 0;
+    if (ok){
+        index->header.bytes -= slot->html_size;
+        *slot = (Index_Slot) {.path = key, .content = content, .html_size = size};
+        set_metadata(slot, st);
+        slot->last_used = ++index->header.clock;
+        index->header.bytes += size;
+        evict_to_fit(cache, slot);
+    }else{
+        unlinkat(cache->dir_fd, temp, 0);
+    }
+    flock(cache->index_fd, LOCK_UN);
+    return ok;
+}
+
+bool copy_fd(int in, int out, size_t size)
+{
+    // copy_file_range() can share the blocks between two files, sendfile()
+    // works for any output, and plain reads and writes are the last resort
+    bool use_copy_range = true;
+    bool use_sendfile = true;
+    char buffer[64*1024];
+    while (size > 0){
+        ssize_t n;
+        if (use_copy_range){
+            n = copy_file_range(in, NULL, out, NULL, size, 0);
+            if (n < 0 && errno != EINTR){
+                use_copy_range = false;
+                continue;
+            }
+        }else if (use_sendfile){
+            n = sendfile(out, in, NULL, size);
+            if (n < 0 && errno != EINTR){
+                use_sendfile = false;
+                continue;
+            }
+        }else{
+            n = read(in, buffer, size < sizeof(buffer) ? size : sizeof(buffer));
+            if (n > 0 && write(out, buffer, n) != n) return false;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return false;
+        if (n == 0) break;
+        size -= n;
+    }
+    return size == 0;
+}
@@ -0,0 +1,34 @@
+#ifndef _DISK_CACHE_H
+#define _DISK_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include <htmd.h>
+
+// On-disk cache of rendered files, shared by every htmd run that uses the same
+// directory. An mmap()ed index maps the path of an input to its HTML, which is
+// kept in a file of its own so a hit can be copied to the output by the kernel.
+typedef struct{
+    int dir_fd;
+    int index_fd;
+    void *index;
+    size_t index_size;
+    size_t max_bytes;
+} Disk_Cache;
+
+bool disk_cache_open(Disk_Cache *cache, const char *dir, size_t max_bytes);
+void disk_cache_close(Disk_Cache *cache);
+// Returns a descriptor of the cached HTML of `path`, or -1. Without `content`
+// the entry has to match the file's size, mtime and inode; with it, the hash
+// of the content is enough (and the metadata of the entry is updated).
+// `variant` stands for the options the HTML depends on: the same file
+// rendered differently is a different entry.
+int disk_cache_find(Disk_Cache *cache, const char *path, uint64_t variant, const struct stat *st, const Htmd_Hash *content);
+bool disk_cache_store(Disk_Cache *cache, const char *path, uint64_t variant, const struct stat *st, Htmd_Hash content, const char *html, size_t size);
+// Copies `size` bytes of the file `in` to `out`, without going through user space if possible.
+bool copy_fd(int in, int out, size_t size);
+
+#endif // _DISK_CACHE_H
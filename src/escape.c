@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include <string.h>
+
+#define NOB_STRIP_PREFIX
+#include <nob.h>
+
+#include "escape.h"
+
+const char* xml_entity(char c)
+{
+    switch (c){
+        case '&': return "&amp;";
+        case '<': return "&lt;";
+        case '>': return "&gt;";
+        case '"': return "&quot;";
+    }
+    return NULL;
+}
+
+void sb_append_xml(String_Builder *sb, const char *data, size_t size)
+{
+    const char *last = data;
+    const char *end = data + size;
+    for (const char *pr = data; pr < end; ++pr){
+        const char *entity = xml_entity(*pr);
+        if (entity == NULL) continue;
+        sb_append_buf(sb, last, pr - last);
+        sb_append_cstr(sb, entity);
+        last = pr + 1;
+    }
+    sb_append_buf(sb, last, end - last);
+}
+
+void sb_append_json(String_Builder *sb, const char *data, size_t size)
+{
+    sb_append_cstr(sb, "\"");
+    const char *last = data;
+    const char *end = data + size;
+    for (const char *pr = data; pr < end; ++pr){
+        unsigned char c = *pr;
+        if (c != '"' && c != '\\' && c >= 0x20) continue;
+        sb_append_buf(sb, last, pr - last);
+        if (c == '"' || c == '\\') sb_appendf(sb, "\\%c", c);
+        else sb_appendf(sb, "\\u%04x", c);
+        last = pr + 1;
+    }
+    sb_append_buf(sb, last, end - last);
+    sb_append_cstr(sb, "\"");
+}
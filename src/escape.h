@@ -0,0 +1,16 @@
+#ifndef _ESCAPE_H
+#define _ESCAPE_H
+
+// Escaping of the text the cli writes into pages, feeds and indexes.
+// Include after <nob.h>.
+
+#include <stddef.h>
+
+// The entity that stands for `c` in HTML and XML text and attribute values,
+// NULL when it can stay as it is.
+const char* xml_entity(char c);
+void sb_append_xml(Nob_String_Builder *sb, const char *data, size_t size);
+// as a JSON string, quotes included
+void sb_append_json(Nob_String_Builder *sb, const char *data, size_t size);
+
+#endif // _ESCAPE_H
@@ -0,0 +1,50 @@
+#ifndef _HTMD_INTERNAL_H
+#define _HTMD_INTERNAL_H
+
+// Shared between the translation units of the library, hidden from its users.
+
+#include <htmd.h>
+
+// Rendered HTML keyed by the hash of its markdown, see render.c.
+typedef struct Fragment{
+    struct Fragment *next; // in the bucket
+    Htmd_Hash key;
+    size_t size;
+    bool referenced;
+    char data[];
+} Fragment;
+
+typedef struct{
+    Fragment **buckets;
+    size_t bucket_count;   // power of two
+    Fragment **clock;      // every entry, in no particular order
+    size_t count;
+    size_t capacity;
+    size_t hand;
+    size_t bytes;
+    size_t budget;
+    size_t insertions;
+    size_t evictions;
+} Fragment_Table;
+
+bool fragment_table_init(Fragment_Table *table, size_t budget);
+void fragment_table_free(Fragment_Table *table);
+Fragment* fragment_find(Fragment_Table *table, Htmd_Hash key);
+Fragment* fragment_alloc(Htmd_Hash key, size_t size);
+// takes ownership of `fragment`, which is freed if it can't be kept
+void fragment_insert(Fragment_Table *table, Fragment *fragment);
+
+// Renders a whole document without handing anything to the writer, so the
+// complete HTML is available from htmd_output() afterwards.
+void htmd_render_held(Htmd_Context *ctx, const char *input, size_t len);
+// Starts a render of a document whose HTML is already known.
+void htmd_render_copy(Htmd_Context *ctx, const char *input, size_t len, const char *html, size_t size);
+// Hands the output collected so far to the writer, if there is one.
+void htmd_flush(Htmd_Context *ctx);
+// The cache key of `input` rendered with the options of `ctx`.
+Htmd_Hash htmd_cache_key(Htmd_Context *ctx, const char *input, size_t len);
+// Whether a whole document may come from an Htmd_Cache: not while it has to
+// be rendered for the link, heading or text function or htmd_toc().
+bool htmd_cacheable(Htmd_Context *ctx);
+
+#endif // _HTMD_INTERNAL_H
@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <htmd.h>
+#include <cwalk.h>
+#include "internal.h"
+
+// Link rewriting
+//
+// Only relative targets whose path (the part before any '#' or '?') ends in
+// .md are rewritten; everything else is left alone before it is hashed. The
+// rewritten targets are kept in a fragment table keyed by the target mixed
+// with the directory of the document, which is hashed once per document.
+
+#define LINKS_PATH_MAX 4096
+
+struct Htmd_Links{
+    Fragment_Table table;
+    char dir[LINKS_PATH_MAX];  // of the current document, "." for none
+    Htmd_Hash dir_hash;
+    char path[LINKS_PATH_MAX];
+    char resolved[LINKS_PATH_MAX];
+    char href[LINKS_PATH_MAX];
+};
+
+Htmd_Links* htmd_links_create(size_t max_bytes)
+{
+    Htmd_Links *links = malloc(sizeof(*links));
+    if (links == NULL) return NULL;
+    if (!fragment_table_init(&links->table, max_bytes)){
+        free(links);
+        return NULL;
+    }
+    htmd_links_set_document(links, "");
+    return links;
+}
+
+void htmd_links_destroy(Htmd_Links *links)
+{
+    if (links == NULL) return;
+    fragment_table_free(&links->table);
+    free(links);
+}
+
+void htmd_links_set_document(Htmd_Links *links, const char *path)
+{
+    size_t dir_len;
+    cwk_path_get_dirname(path, &dir_len);
+    if (dir_len == 0 || dir_len >= sizeof(links->dir)){
+        strcpy(links->dir, ".");
+    }else{
+        memcpy(links->dir, path, dir_len);
+        links->dir[dir_len] = '\0';
+        cwk_path_normalize(links->dir, links->dir, sizeof(links->dir));
+    }
+    links->dir_hash = htmd_hash(links->dir, strlen(links->dir));
+}
+
+// "https:", "mailto:", ...
+bool has_scheme(const char *target, size_t size)
+{
+    for (size_t i = 0; i < size; ++i){
+        char c = target[i];
+        if (c == ':') return i > 0;
+        bool scheme_char = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '+' || c == '-' || c == '.';
+        if (!scheme_char) return false;
+    }
+    return false;
+}
+
+bool htmd_link_is_relative(const char *target, size_t size)
+{
+    return size > 0 && target[0] != '/' && target[0] != '#' && target[0] != '?' && !has_scheme(target, size);
+}
+
+const char* htmd_links_rewrite(void *user, const char *target, size_t size, size_t line, size_t *new_size)
+{
+    (void) line;
+    Htmd_Links *links = user;
+    size_t path_len = 0;
+    while (path_len < size && target[path_len] != '#' && target[path_len] != '?') path_len += 1;
+    if (path_len < 4 || memcmp(target + path_len - 3, ".md", 3) != 0) return NULL;
+    if (!htmd_link_is_relative(target, path_len)) return NULL;
+    if (path_len >= sizeof(links->path)) return NULL;
+
+    Htmd_Hash key = htmd_hash(target, size);
+    key.lo ^= links->dir_hash.lo;
+    key.hi ^= links->dir_hash.hi*0x9E3779B97F4A7C15ull;
+    Fragment *f = fragment_find(&links->table, key);
+    if (f != NULL){
+        f->referenced = true;
+        *new_size = f->size;
+        return f->data;
+    }
+
+    // dir/../guide/setup.md -> ../guide/setup.html, relative to dir again
+    memcpy(links->path, target, path_len);
+    links->path[path_len] = '\0';
+    cwk_path_join(links->dir, links->path, links->resolved, sizeof(links->resolved));
+    cwk_path_change_extension(links->resolved, ".html", links->resolved, sizeof(links->resolved));
+    size_t href_len = cwk_path_get_relative(links->dir, links->resolved, links->href, sizeof(links->href));
+    if (href_len == 0 || href_len + (size - path_len) >= sizeof(links->href)) return NULL;
+    memcpy(links->href + href_len, target + path_len, size - path_len);
+    href_len += size - path_len;
+
+    f = fragment_alloc(key, href_len);
+    if (f != NULL){
+        memcpy(f->data, links->href, href_len);
+        fragment_insert(&links->table, f);
+    }
+    *new_size = href_len;
+    return links->href;
+}
@@ -0,0 +1,196 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <cwalk.h>
+#include "output.h"
+
+// pages of up to this many pieces are copied on the stack for writev_all()
+#define OUTPUT_STACK_IOV 16
+
+static atomic_uint temp_counter;
+
+bool writev_all(int fd, struct iovec *iov, int n)
+{
+    while (n > 0){
+        ssize_t written = writev(fd, iov, n < IOV_MAX ? n : IOV_MAX);
+        if (written < 0){
+            if (errno == EINTR) continue;
+            return false;
+        }
+        while (n > 0 && (size_t) written >= iov->iov_len){
+            written -= iov->iov_len;
+            iov += 1;
+            n -= 1;
+        }
+        if (n > 0){
+            iov->iov_base = (char*) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+bool writev_copy(int fd, const struct iovec *iov, int n)
+{
+    // a page from a template has a piece per placeholder and literal
+    struct iovec stack_pieces[OUTPUT_STACK_IOV];
+    struct iovec *pieces = n <= OUTPUT_STACK_IOV ? stack_pieces : malloc(n*sizeof(*pieces));
+    assert(pieces != NULL && "Buy more RAM");
+    memcpy(pieces, iov, n*sizeof(*iov));
+    bool ok = writev_all(fd, pieces, n);
+    if (pieces != stack_pieces) free(pieces);
+    return ok;
+}
+
+// compares the size (from `st`, the file's) first, and the content only if that matches
+bool same_content(int fd, const struct stat *st, const struct iovec *iov, int n, size_t *syscalls)
+{
+    size_t total = 0;
+    for (int i = 0; i < n; ++i) total += iov[i].iov_len;
+    if (!S_ISREG(st->st_mode) || (size_t) st->st_size != total) return false;
+    if (total == 0) return true;
+    const char *old = mmap(NULL, total, PROT_READ, MAP_PRIVATE, fd, 0);
+    *syscalls += 1;
+    if (old == MAP_FAILED) return false;
+    bool same = true;
+    size_t offset = 0;
+    for (int i = 0; same && i < n; ++i){
+        same = memcmp(old + offset, iov[i].iov_base, iov[i].iov_len) == 0;
+        offset += iov[i].iov_len;
+    }
+    munmap((void*) old, total);
+    *syscalls += 1;
+    return same;
+}
+
+Write_Result write_if_changed(const char *path, const struct iovec *iov, int n, mode_t mode, size_t *syscalls)
+{
+    size_t ignored = 0;
+    if (syscalls == NULL) syscalls = &ignored;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    *syscalls += 1;
+    bool exists = fd >= 0 || errno != ENOENT;
+    // a file that is replaced keeps its mode
+    bool keep_mode = false;
+    if (fd >= 0){
+        struct stat st;
+        *syscalls += 1;
+        bool same = false;
+        if (fstat(fd, &st) == 0){
+            same = same_content(fd, &st, iov, n, syscalls);
+            keep_mode = true;
+            mode = st.st_mode & 07777;
+        }
+        close(fd);
+        *syscalls += 1;
+        if (same) return Write_Unchanged;
+    }
+
+    // The new content goes into an unnamed file (O_TMPFILE) that is linked
+    // in once complete: under `path` itself if that doesn't exist, else
+    // under a temporary name that is renamed over it. File systems without
+    // O_TMPFILE get a named temporary file right away.
+    char dir[FILENAME_MAX];
+    char temp[FILENAME_MAX + 32];
+    size_t dir_len;
+    cwk_path_get_dirname(path, &dir_len);
+    if (dir_len == 0 || dir_len >= sizeof(dir)) strcpy(dir, ".");
+    else{
+        memcpy(dir, path, dir_len);
+        dir[dir_len] = '\0';
+    }
+    snprintf(temp, sizeof(temp), "%s.%d.%u.tmp", path, (int) getpid(), atomic_fetch_add(&temp_counter, 1));
+    bool named = false;
+    fd = open(dir, O_TMPFILE | O_WRONLY | O_CLOEXEC, mode);
+    *syscalls += 1;
+    if (fd < 0){
+        fd = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+        *syscalls += 1;
+        named = true;
+    }
+    if (fd < 0){
+        fprintf(stderr, "[ERROR] Could not create '%s': %s\n", path, strerror(errno));
+        return Write_Failed;
+    }
+
+    bool ok = writev_copy(fd, iov, n);
+    *syscalls += 1;
+    // the mode given to open() went through the umask
+    if (ok && keep_mode){
+        ok = fchmod(fd, mode) == 0;
+        *syscalls += 1;
+    }
+    if (ok && !named){
+        char proc[64];
+        snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+        if (!exists){
+            *syscalls += 1;
+            if (linkat(AT_FDCWD, proc, AT_FDCWD, path, AT_SYMLINK_FOLLOW) == 0){
+                close(fd);
+                *syscalls += 1;
+                return Write_Done;
+            }
+        }
+        ok = linkat(AT_FDCWD, proc, AT_FDCWD, temp, AT_SYMLINK_FOLLOW) == 0;
+        *syscalls += 1;
+        named = ok;
+    }
+    close(fd);
+    *syscalls += 1;
+    if (ok){
+        ok = rename(temp, path) == 0;
+        *syscalls += 1;
+    }
+    if (!ok){
+        fprintf(stderr, "[ERROR] Could not write '%s': %s\n", path, strerror(errno));
+        if (named) unlink(temp);
+        return Write_Failed;
+    }
+    return Write_Done;
+}
+
+Write_Result copy_if_changed(const char *src, const char *dst, size_t *syscalls)
+{
+    size_t ignored = 0;
+    if (syscalls == NULL) syscalls = &ignored;
+    int fd = open(src, O_RDONLY | O_CLOEXEC);
+    *syscalls += 1;
+    if (fd < 0){
+        fprintf(stderr, "[ERROR] Could not open '%s': %s\n", src, strerror(errno));
+        return Write_Failed;
+    }
+    struct stat st;
+    void *data = NULL;
+    *syscalls += 1;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok && st.st_size > 0){
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        *syscalls += 1;
+        ok = data != MAP_FAILED;
+    }
+    Write_Result result = Write_Failed;
+    if (ok){
+        struct iovec iov = {data, st.st_size};
+        result = write_if_changed(dst, &iov, 1, st.st_mode & 07777, syscalls);
+        if (data != NULL){
+            munmap(data, st.st_size);
+            *syscalls += 1;
+        }
+    }else{
+        fprintf(stderr, "[ERROR] Could not read '%s': %s\n", src, strerror(errno));
+    }
+    close(fd);
+    *syscalls += 1;
+    return result;
+}
@@ -0,0 +1,28 @@
+#ifndef _OUTPUT_H
+#define _OUTPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <sys/types.h>
+
+typedef enum{
+    Write_Failed,
+    Write_Done,
+    Write_Unchanged,
+} Write_Result;
+
+// Writes all of `iov`, retrying short writes. Changes `iov`.
+bool writev_all(int fd, struct iovec *iov, int n);
+// writev_all() on a copy of `iov`, which stays as it is
+bool writev_copy(int fd, const struct iovec *iov, int n);
+// Replaces `path` with the concatenation of `iov` unless it holds exactly
+// that already, so unchanged outputs keep their mtime. The new file only
+// appears under `path` once it is complete. A new file gets `mode` (less the
+// umask), a replaced one keeps the mode it had. `syscalls` (optional) counts
+// the system calls made.
+Write_Result write_if_changed(const char *path, const struct iovec *iov, int n, mode_t mode, size_t *syscalls);
+// copy_file() through write_if_changed(), with the mode of `src`
+Write_Result copy_if_changed(const char *src, const char *dst, size_t *syscalls);
+
+#endif // _OUTPUT_H
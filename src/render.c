@@ -1,16 +1,23 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
-#include <dirent.h>
+#include <stdint.h>
+#include <assert.h>
+#include <time.h>
 
 #include <htmd.h>
+#include "internal.h"
 
-#ifndef HTMD_CLI
-#define NOB_IMPLEMENTATION
-#endif // HTMD_CLI
-#define NOB_STRIP_PREFIX
-#define NOB_NO_MINIRENT
-#include <nob.h>
+#ifdef __EMSCRIPTEN__
+#include <emscripten/emscripten.h>
+#else
+#define EMSCRIPTEN_KEEPALIVE
+#endif // __EMSCRIPTEN__
+
+// Thread safety: the renderer keeps all mutable state in its Htmd_Context and
+// has no globals apart from constant tables. It deliberately doesn't use
+// nob.h, whose temporary allocator is a global buffer.
 
 typedef enum{
     Style_Bold,
@@ -20,187 +27,742 @@ typedef enum{
     _Style_Count
 } Style;
 
-char* strchrnul(const char *r, int c)
+// Character classes, resolved by the compiler into a single static table so
+// every classification is one load and one mask (no locale lookups).
+#define CC_SPACE  (1u << 0) // ' ', '\t', '\v'
+#define CC_DIGIT  (1u << 1) // '0'..'9'
+#define CC_ALPHA  (1u << 2) // 'a'..'z', 'A'..'Z'
+#define CC_INLINE (1u << 3) // characters that may start inline markup
+#define CC_ENTITY (1u << 4) // and in plain text, where entities are decoded
+
+static const unsigned char char_class[256] = {
+    [' '] = CC_SPACE, ['\t'] = CC_SPACE, ['\v'] = CC_SPACE,
+    ['0' ... '9'] = CC_DIGIT,
+    ['a' ... 'z'] = CC_ALPHA,
+    ['A' ... 'Z'] = CC_ALPHA,
+    ['`'] = CC_INLINE, ['*'] = CC_INLINE, ['_'] = CC_INLINE, ['~'] = CC_INLINE,
+    ['['] = CC_INLINE, ['!'] = CC_INLINE, ['<'] = CC_INLINE, ['\\'] = CC_INLINE,
+    ['&'] = CC_ENTITY,
+};
+
+#define char_is(c, cls) ((char_class[(unsigned char) (c)] & (cls)) != 0)
+
+// All scanners work on [pr, end) spans of the input, so lines are never copied
+// and nothing reads past the end of a line.
+
+// compares against a string literal without calling strlen() at runtime
+#define starts_with(pr, end, pattern) ((size_t) ((end)-(pr)) >= sizeof(pattern)-1 && memcmp((pr), (pattern), sizeof(pattern)-1) == 0)
+
+char* find_char(char *pr, char *end, char c)
 {
-    char *p = strchr(r, c);
-    if (p == NULL) return (char*)r+strlen(r);
+    char *p = memchr(pr, c, end-pr);
+    if (p == NULL) return end;
     return p;
 }
 
-char* find_close(char *pr, char s, char e)
+char* find_close(char *pr, char *end, char s, char e)
 {
     size_t depth = 1;
-    while (true){
+    for (; pr < end; ++pr){
         char c = *pr;
         if (c == s) depth+=1;
         else if (c == e) depth-=1;
-        
-        if (depth == 0 || c == '\0') return pr;
-        ++pr;
+        if (depth == 0) return pr;
     }
+    return end;
 }
 
-size_t count_char(char *pr, char c)
+size_t count_char(char *pr, char *end, char c)
 {
     size_t count = 0;
-    while (*pr++ == c) ++count;
+    while (pr < end && *pr++ == c) ++count;
     return count;
 }
 
-char* get_next_line(char *line_start, char *buffer, size_t buffer_size)
+char* skip_whitespace(char *pr, char *end)
+{
+    while (pr < end && char_is(*pr, CC_SPACE)) ++pr;
+    return pr;
+}
+
+char* find_word_end(char *pr, char *end)
+{
+    while (pr < end && char_is(*pr, CC_ALPHA)) ++pr;
+    return pr;
+}
+
+// Block structure
+//
+// The document is parsed in a single forward pass, one line at a time. Open
+// blockquotes and list items live on a container stack: each line first
+// continues as many open containers as its prefix allows ('>' markers for
+// quotes, indentation for list items), closes the rest, opens any new
+// containers it starts with and hands what is left to a leaf block (heading,
+// rule, code or text). A container is pushed and popped exactly once, so apart
+// from walking the prefix characters the line actually has, the work per line
+// does not grow with the nesting depth.
+
+#define MAX_NESTING_DEPTH 32
+#define TAB_WIDTH 4
+
+typedef enum{
+    Container_Quote,
+    Container_Unordered,
+    Container_Ordered,
+} Container_Kind;
+
+typedef struct{
+    Container_Kind kind;
+    size_t content_column; // list items: column at which the item's content starts
+    bool has_text;         // list items: a text line was already rendered into the item
+    bool inline_open;      // list items: the <li> line is not terminated yet
+} Container;
+
+typedef enum{
+    Leaf_None,
+    Leaf_Fenced_Code,
+    Leaf_Indented_Code,
+} Leaf_Kind;
+
+typedef enum{
+    Front_Matter_Maybe,      // before the first line
+    Front_Matter_Fence,      // the first line was "---"
+    Front_Matter_Open,       // pairs followed it, the closing line hasn't come yet
+    Front_Matter_Done,
+} Front_Matter;
+
+typedef struct{
+    Container stack[MAX_NESTING_DEPTH];
+    size_t depth;
+    Leaf_Kind leaf;          // code blocks are the only leaves spanning lines
+    size_t pending_blanks;   // blank lines held back while an indented code block may continue
+    bool last_line_empty;
+    Front_Matter front_matter;
+} Block_Parser;
+
+// Memory
+//
+// Everything the renderer allocates goes through the allocator of its
+// context, so embedders can account for or redirect every byte.
+
+void* libc_alloc(void *user, size_t size)
 {
-    if (line_start == NULL || buffer == NULL || *line_start == '\0') return NULL;
-    char *line_end = strchrnul(line_start, '\n');
-    size_t line_len = line_end - line_start;
-    size_t write_size = line_len < buffer_size-1 ? line_len : buffer_size-2;
-    (void) memcpy(buffer, line_start, write_size);
-    buffer[write_size] = '\0';
-    if (*line_end == '\0') return line_end;
-    return line_end + 1;
+    (void) user;
+    return malloc(size);
 }
 
-bool starts_with(char *string, const char *pattern)
+void* libc_realloc(void *user, void *ptr, size_t old_size, size_t new_size)
 {
-    return strncmp(string, pattern, strlen(pattern)) == 0;
+    (void) user;
+    (void) old_size;
+    return realloc(ptr, new_size);
 }
 
-bool is_code_block(char *line)
+void libc_free(void *user, void *ptr, size_t size)
 {
-    char *pr = line;
-    size_t indent = 0;
-    while (indent < 4){
-        switch (*pr){
-            case ' ': {
-                indent += 1;
-            }break;
-            case '\t':{
-                indent += 4;
-            }break;
-            default:{
-                if (starts_with(pr, "```")) return true;
-                return false;
-            }
+    (void) user;
+    (void) size;
+    free(ptr);
+}
+
+static const Htmd_Allocator libc_allocator = {
+    .alloc = libc_alloc,
+    .realloc = libc_realloc,
+    .free = libc_free,
+};
+
+void* counting_alloc(void *user, size_t size)
+{
+    Htmd_Alloc_Counter *counter = user;
+    void *ptr = counter->parent->alloc(counter->parent->user, size);
+    if (ptr == NULL) return NULL;
+    counter->allocations += 1;
+    counter->bytes_requested += size;
+    counter->bytes_in_use += size;
+    if (counter->bytes_in_use > counter->high_water) counter->high_water = counter->bytes_in_use;
+    return ptr;
+}
+
+void* counting_realloc(void *user, void *ptr, size_t old_size, size_t new_size)
+{
+    Htmd_Alloc_Counter *counter = user;
+    void *new_ptr = counter->parent->realloc(counter->parent->user, ptr, old_size, new_size);
+    if (new_ptr == NULL) return NULL;
+    counter->allocations += 1;
+    counter->bytes_requested += new_size;
+    if (ptr != NULL && new_ptr != ptr) counter->bytes_copied += old_size < new_size ? old_size : new_size;
+    counter->bytes_in_use += new_size - old_size;
+    if (counter->bytes_in_use > counter->high_water) counter->high_water = counter->bytes_in_use;
+    return new_ptr;
+}
+
+void counting_free(void *user, void *ptr, size_t size)
+{
+    Htmd_Alloc_Counter *counter = user;
+    if (ptr == NULL) return;
+    counter->parent->free(counter->parent->user, ptr, size);
+    counter->frees += 1;
+    counter->bytes_in_use -= size;
+}
+
+Htmd_Allocator htmd_counting_allocator(Htmd_Alloc_Counter *counter)
+{
+    if (counter->parent == NULL) counter->parent = &libc_allocator;
+    return (Htmd_Allocator) {
+        .alloc = counting_alloc,
+        .realloc = counting_realloc,
+        .free = counting_free,
+        .user = counter,
+    };
+}
+
+// Bump arena: allocations are carved out of large blocks and released all at
+// once by htmd_arena_reset(). The blocks are kept for the next document, so a
+// context that renders many documents stops calling its parent allocator once
+// the arena has grown to fit the largest one.
+
+#define ARENA_ALIGNMENT 16
+#define ARENA_DEFAULT_BLOCK_SIZE (64*1024)
+
+struct Htmd_Arena_Block{
+    Htmd_Arena_Block *next;
+    size_t capacity;
+    size_t used;
+    char data[];
+};
+
+char* arena_align(char *pr)
+{
+    return (char*) (((uintptr_t) pr + ARENA_ALIGNMENT-1) & ~(uintptr_t) (ARENA_ALIGNMENT-1));
+}
+
+void* arena_alloc(void *user, size_t size)
+{
+    Htmd_Arena *arena = user;
+    for (Htmd_Arena_Block *block = arena->current; block != NULL; block = block->next){
+        char *pr = arena_align(block->data + block->used);
+        if (pr + size <= block->data + block->capacity){
+            block->used = pr + size - block->data;
+            arena->current = block;
+            arena->last = pr;
+            return pr;
         }
-        ++pr;
     }
+    const Htmd_Allocator *parent = arena->parent != NULL ? arena->parent : &libc_allocator;
+    size_t capacity = arena->block_size != 0 ? arena->block_size : ARENA_DEFAULT_BLOCK_SIZE;
+    if (capacity < size + ARENA_ALIGNMENT) capacity = size + ARENA_ALIGNMENT;
+    Htmd_Arena_Block *block = parent->alloc(parent->user, sizeof(*block) + capacity);
+    if (block == NULL) return NULL;
+    block->next = NULL;
+    block->capacity = capacity;
+    char *pr = arena_align(block->data);
+    block->used = pr + size - block->data;
+
+    Htmd_Arena_Block **tail = arena->current != NULL ? &arena->current->next : &arena->first;
+    while (*tail != NULL) tail = &(*tail)->next;
+    *tail = block;
+    arena->current = block;
+    arena->last = pr;
+    return pr;
+}
+
+void* arena_realloc(void *user, void *ptr, size_t old_size, size_t new_size)
+{
+    Htmd_Arena *arena = user;
+    if (ptr == NULL) return arena_alloc(user, new_size);
+    // the most recent allocation grows in place while its block has room
+    Htmd_Arena_Block *block = arena->current;
+    if (ptr == arena->last && (char*) ptr + new_size <= block->data + block->capacity){
+        block->used = (char*) ptr + new_size - block->data;
+        return ptr;
+    }
+    void *new_ptr = arena_alloc(user, new_size);
+    if (new_ptr == NULL) return NULL;
+    memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    return new_ptr;
+}
+
+void arena_free(void *user, void *ptr, size_t size)
+{
+    (void) size;
+    Htmd_Arena *arena = user;
+    if (ptr == NULL || ptr != arena->last) return;
+    arena->current->used = (char*) ptr - arena->current->data;
+    arena->last = NULL;
+}
+
+Htmd_Allocator htmd_arena_allocator(Htmd_Arena *arena)
+{
+    return (Htmd_Allocator) {
+        .alloc = arena_alloc,
+        .realloc = arena_realloc,
+        .free = arena_free,
+        .user = arena,
+    };
+}
+
+void htmd_arena_reset(Htmd_Arena *arena)
+{
+    for (Htmd_Arena_Block *block = arena->first; block != NULL; block = block->next){
+        block->used = 0;
+    }
+    arena->current = arena->first;
+    arena->last = NULL;
+}
+
+void htmd_arena_release(Htmd_Arena *arena)
+{
+    const Htmd_Allocator *parent = arena->parent != NULL ? arena->parent : &libc_allocator;
+    Htmd_Arena_Block *block = arena->first;
+    while (block != NULL){
+        Htmd_Arena_Block *next = block->next;
+        parent->free(parent->user, block, sizeof(*block) + block->capacity);
+        block = next;
+    }
+    arena->first = NULL;
+    arena->current = NULL;
+    arena->last = NULL;
+}
+
+typedef struct{
+    char *items;
+    size_t count;
+    size_t capacity;
+} Buffer;
+
+typedef enum{
+    Output_Buffer, // growing buffer, handed to the writer in pieces
+    Output_Rope,   // segments referencing the input
+    Output_Fixed,  // caller's buffer that never grows; `out.count` counts all bytes, even those that didn't fit
+} Output_Mode;
+
+struct Htmd_Context{
+    Htmd_Options options;
+    Htmd_Allocator allocator; // the context itself
+    Htmd_Arena own_arena;     // used unless the options bring an arena
+    Htmd_Allocator scratch;   // per render memory: output, carry
+    Block_Parser parser;
+    Buffer out;
+    Buffer carry;
+    Output_Mode output_mode;
+    struct{
+        Htmd_Segment *items;
+        size_t count;
+        size_t capacity;
+    } rope;
+    size_t rope_bytes;
+    char *rope_chunk;      // owned bytes of the rope
+    size_t rope_chunk_size;
+    size_t rope_chunk_used;
+    Htmd_Stats stats;
+    uint64_t parse_nanos;  // time spent in the parser, including inline rendering
+    size_t flushed_bytes;  // output already handed to the writer
+    bool hold_output;      // keep the whole output until the render is done
+    bool block_uncacheable; // the current block's HTML depends on the rest of the document
+    Htmd_Hash cache_variant; // of the options that change the output, see htmd_cache_key()
+    bool plain;            // Htmd_Format_Text: markup is left out
+    bool input_kept;       // the whole input stays where it is until the next render
+    bool front_matter_known; // whether the document has front matter was decided before parsing
+
+    // heading ids and the table of contents
+    Buffer heading;        // text of the current heading, without markup
+    Buffer heading_id;
+    struct{
+        uint64_t *slots;   // hashes of the ids given out so far, 0: empty
+        size_t mask;
+        size_t count;
+    } ids;
+    Buffer toc;            // HTML of the table of contents so far
+    size_t toc_levels[6];  // of the lists open in it
+    size_t toc_depth;
+    bool toc_pending;      // the table of contents isn't in the output yet, which is held back until it is
+    bool toc_marked;       // the position for it was given by a marker
+    size_t toc_at;         // output offset, or rope segment, to insert it at
+    size_t toc_at_size;    // size of the rope segment before it at the time
+
+    struct{
+        Htmd_Meta *items;
+        size_t count;
+        size_t capacity;
+    } meta;                // the front matter
+    struct{
+        Htmd_Segment *items;
+        size_t count;
+        size_t capacity;
+    } held;                // its lines, until the closing line shows it is one
+};
+
+// Rendering
+void render_text_field(char *pr, char *end, Htmd_Context *ctx);
+
+// Memory
+//
+// Per render memory comes from the scratch allocator. When it runs out the
+// render is marked (Htmd_Stats.out_of_memory), what was allocated stays
+// valid and nothing more is appended: htmd_render() returns NULL then and
+// htmd_finish() false.
+
+void* scratch_alloc(Htmd_Context *ctx, size_t size)
+{
+    void *ptr = ctx->stats.out_of_memory ? NULL : ctx->scratch.alloc(ctx->scratch.user, size);
+    if (ptr == NULL) ctx->stats.out_of_memory = true;
+    return ptr;
+}
+
+// leaves `ptr` as it is when it fails
+void* scratch_realloc(Htmd_Context *ctx, void *ptr, size_t old_size, size_t new_size)
+{
+    void *new_ptr = ctx->stats.out_of_memory ? NULL : ctx->scratch.realloc(ctx->scratch.user, ptr, old_size, new_size);
+    if (new_ptr == NULL) ctx->stats.out_of_memory = true;
+    return new_ptr;
+}
+
+bool buffer_reserve(Htmd_Context *ctx, Buffer *buffer, size_t size)
+{
+    if (buffer->count + size <= buffer->capacity) return true;
+    size_t capacity = buffer->capacity == 0 ? 256 : buffer->capacity;
+    while (capacity < buffer->count + size) capacity *= 2;
+    char *items = scratch_realloc(ctx, buffer->items, buffer->capacity, capacity);
+    if (items == NULL) return false;
+    buffer->items = items;
+    buffer->capacity = capacity;
     return true;
 }
 
-char* skip_whitespace(char *pr)
+void buffer_append(Htmd_Context *ctx, Buffer *buffer, const char *data, size_t size)
 {
-    while (true){
-        switch (*pr){
-            case ' ':
-            case '\t':
-            case '\v':{
-                pr += 1;
-            }break;
-            default: return pr;
+    if (ctx->stats.out_of_memory || !buffer_reserve(ctx, buffer, size)) return;
+    memcpy(buffer->items + buffer->count, data, size);
+    buffer->count += size;
+}
+
+// Output
+//
+// By default the HTML is assembled in one contiguous buffer. In rope mode
+// (htmd_render_rope) it becomes a list of segments instead: runs of the input
+// are referenced where they are and never copied. Pieces shorter than
+// ROPE_MIN_REF_SIZE (tags, short words between markup) are packed into small
+// owned chunks instead, since a segment of their own would cost more than
+// the bytes it saves.
+
+#define ROPE_MIN_REF_SIZE 64
+#define ROPE_CHUNK_SIZE 4096
+
+bool rope_reserve(Htmd_Context *ctx, size_t count)
+{
+    if (ctx->rope.count + count <= ctx->rope.capacity) return true;
+    size_t capacity = ctx->rope.capacity == 0 ? 256 : ctx->rope.capacity;
+    while (capacity < ctx->rope.count + count) capacity *= 2;
+    Htmd_Segment *items = scratch_realloc(ctx, ctx->rope.items, ctx->rope.capacity*sizeof(Htmd_Segment), capacity*sizeof(Htmd_Segment));
+    if (items == NULL) return false;
+    ctx->rope.items = items;
+    ctx->rope.capacity = capacity;
+    return true;
+}
+
+void rope_push(Htmd_Context *ctx, const char *data, size_t size)
+{
+    if (ctx->stats.out_of_memory) return;
+    if (ctx->rope.count > 0){
+        Htmd_Segment *last = &ctx->rope.items[ctx->rope.count-1];
+        if (last->data + last->size == data){
+            last->size += size;
+            return;
         }
     }
+    if (!rope_reserve(ctx, 1)) return;
+    ctx->rope.items[ctx->rope.count++] = (Htmd_Segment) {.data = data, .size = size};
 }
 
-char* find_word_end(char *pr)
+// inserts a segment before segment `at`
+void rope_insert(Htmd_Context *ctx, size_t at, const char *data, size_t size)
 {
-    while (isalpha(*pr)) ++pr;
-    return pr;
+    if (!rope_reserve(ctx, 1)) return;
+    memmove(&ctx->rope.items[at+1], &ctx->rope.items[at], (ctx->rope.count - at)*sizeof(Htmd_Segment));
+    ctx->rope.items[at] = (Htmd_Segment) {.data = data, .size = size};
+    ctx->rope.count += 1;
 }
 
-char* is_enum(char *line)
+void rope_copy(Htmd_Context *ctx, const char *data, size_t size)
 {
-    char *pr = skip_whitespace(line);
-    if (isdigit(*pr++) && *pr++ == '.') return pr;
-    return NULL;
+    while (size > 0 && !ctx->stats.out_of_memory){
+        if (ctx->rope_chunk_used == ctx->rope_chunk_size){
+            size_t chunk_size = size > ROPE_CHUNK_SIZE ? size : ROPE_CHUNK_SIZE;
+            char *chunk = scratch_alloc(ctx, chunk_size);
+            if (chunk == NULL) return;
+            ctx->rope_chunk = chunk;
+            ctx->rope_chunk_size = chunk_size;
+            ctx->rope_chunk_used = 0;
+        }
+        size_t n = ctx->rope_chunk_size - ctx->rope_chunk_used;
+        if (n > size) n = size;
+        char *dst = ctx->rope_chunk + ctx->rope_chunk_used;
+        memcpy(dst, data, n);
+        ctx->rope_chunk_used += n;
+        rope_push(ctx, dst, n);
+        data += n;
+        size -= n;
+    }
 }
 
-char* is_list(char *line)
+void fixed_append(Htmd_Context *ctx, const char *data, size_t size)
 {
-    char *pr = skip_whitespace(line);
-    if (*pr == '-') return pr+1;
-    return NULL;
+    if (ctx->out.count + size <= ctx->out.capacity) memcpy(ctx->out.items + ctx->out.count, data, size);
+    ctx->out.count += size;
 }
 
-bool line_is_empty(char *line)
+// appends bytes that outlive the render: the input and static strings
+void out_append_ref(Htmd_Context *ctx, const char *data, size_t size)
 {
-    char *pr = skip_whitespace(line);
-    return *pr == '\0';
+    switch (ctx->output_mode){
+        case Output_Buffer:{
+            buffer_append(ctx, &ctx->out, data, size);
+        }break;
+        case Output_Rope:{
+            ctx->rope_bytes += size;
+            if (size >= ROPE_MIN_REF_SIZE) rope_push(ctx, data, size);
+            else rope_copy(ctx, data, size);
+        }break;
+        case Output_Fixed:{
+            fixed_append(ctx, data, size);
+        }break;
+    }
 }
 
-// Rendering
-void render_text_field(char *pr, size_t n, String_Builder *sb);
+// appends bytes that may go away, a rope gets its own copy
+void out_append(Htmd_Context *ctx, const char *data, size_t size)
+{
+    switch (ctx->output_mode){
+        case Output_Buffer:{
+            buffer_append(ctx, &ctx->out, data, size);
+        }break;
+        case Output_Rope:{
+            ctx->rope_bytes += size;
+            rope_copy(ctx, data, size);
+        }break;
+        case Output_Fixed:{
+            fixed_append(ctx, data, size);
+        }break;
+    }
+}
+
+#define out_append_lit(ctx, lit) out_append_ref((ctx), (lit), sizeof(lit)-1)
+#define out_append_cstr(ctx, cstr) out_append_ref((ctx), (cstr), strlen(cstr)) // static strings only
+
+// Plain text output runs through the same parser and only differs in what is
+// appended: tags are dropped, and markup that separates lines becomes "\n".
+#define out_tag_lit(ctx, lit) do{ if (!(ctx)->plain) out_append_lit((ctx), (lit)); }while(0)
+#define out_tag_cstr(ctx, cstr) do{ if (!(ctx)->plain) out_append_cstr((ctx), (cstr)); }while(0)
+#define out_markup_lit(ctx, html, text) ((ctx)->plain ? out_append_lit((ctx), (text)) : out_append_lit((ctx), (html)))
+#define out_markup_cstr(ctx, html, text) ((ctx)->plain ? out_append_lit((ctx), (text)) : out_append_cstr((ctx), (html)))
+
+void out_append_target(Htmd_Context *ctx, const char *target, size_t size)
+{
+    if (ctx->options.link != NULL){
+        size_t new_size;
+        const char *rewritten = ctx->options.link(ctx->options.link_user, target, size, ctx->stats.lines, &new_size);
+        if (rewritten != NULL){
+            out_append(ctx, rewritten, new_size);
+            return;
+        }
+    }
+    out_append_ref(ctx, target, size);
+}
+
+// appends text of the document, which Htmd_Options.text gets as well
+void out_text(Htmd_Context *ctx, const char *data, size_t size)
+{
+    out_append_ref(ctx, data, size);
+    if (ctx->options.text != NULL && size > 0) ctx->options.text(ctx->options.text_user, data, size);
+}
+
+// appends text that isn't in the document as it is, e.g. a decoded entity
+void out_text_copy(Htmd_Context *ctx, const char *data, size_t size)
+{
+    out_append(ctx, data, size);
+    if (ctx->options.text != NULL) ctx->options.text(ctx->options.text_user, data, size);
+}
 
-char* try_render_link(char *pr, String_Builder *sb)
+#define ENTITY_MAX_NAME 8
+
+// Plain text: the character an entity stands for, as UTF-8. Only the named
+// entities HTML needs to escape with (and &nbsp;) are known, numeric ones are
+// all decoded.
+char* try_render_entity(char *pr, char *end, Htmd_Context *ctx)
+{
+    static const struct{ const char *name; const char *text; } entities[] = {
+        {"amp", "&"}, {"lt", "<"}, {"gt", ">"}, {"quot", "\""}, {"apos", "'"}, {"nbsp", "\xc2\xa0"},
+    };
+    char *name = pr + 1;
+    char *semicolon = find_char(name, end - name > ENTITY_MAX_NAME ? name + ENTITY_MAX_NAME : end, ';');
+    if (semicolon == end || *semicolon != ';' || semicolon == name) return NULL;
+    if (*name != '#'){
+        for (size_t i = 0; i < sizeof(entities)/sizeof(*entities); ++i){
+            if (strlen(entities[i].name) != (size_t) (semicolon - name) || memcmp(entities[i].name, name, semicolon - name) != 0) continue;
+            out_text_copy(ctx, entities[i].text, strlen(entities[i].text));
+            return semicolon;
+        }
+        return NULL;
+    }
+    bool hex = name + 1 < semicolon && (name[1] == 'x' || name[1] == 'X');
+    char *digits = name + 1 + hex;
+    if (digits == semicolon) return NULL;
+    uint32_t code = 0;
+    for (char *d = digits; d < semicolon; ++d){
+        uint32_t digit;
+        if (*d >= '0' && *d <= '9') digit = *d - '0';
+        else if (hex && (*d | 0x20) >= 'a' && (*d | 0x20) <= 'f') digit = (*d | 0x20) - 'a' + 10;
+        else return NULL;
+        code = code*(hex ? 16 : 10) + digit;
+    }
+    if (code == 0 || code > 0x10FFFF || (code >= 0xD800 && code <= 0xDFFF)) return NULL;
+    char utf8[4];
+    size_t size;
+    if (code < 0x80){
+        utf8[0] = code;
+        size = 1;
+    }else if (code < 0x800){
+        utf8[0] = 0xC0 | code >> 6;
+        utf8[1] = 0x80 | (code & 0x3F);
+        size = 2;
+    }else if (code < 0x10000){
+        utf8[0] = 0xE0 | code >> 12;
+        utf8[1] = 0x80 | (code >> 6 & 0x3F);
+        utf8[2] = 0x80 | (code & 0x3F);
+        size = 3;
+    }else{
+        utf8[0] = 0xF0 | code >> 18;
+        utf8[1] = 0x80 | (code >> 12 & 0x3F);
+        utf8[2] = 0x80 | (code >> 6 & 0x3F);
+        utf8[3] = 0x80 | (code & 0x3F);
+        size = 4;
+    }
+    out_text_copy(ctx, utf8, size);
+    return semicolon;
+}
+
+char* try_render_link(char *pr, char *end, Htmd_Context *ctx)
 {
     char *display_start = ++pr;
-    char *display_end = find_close(pr, '[', ']');
+    char *display_end = find_close(pr, end, '[', ']');
     pr = display_end;
-    if (*pr == '\0') return NULL;
-    if (*++pr != '(') return NULL;
+    if (pr == end) return NULL;
+    if (++pr == end || *pr != '(') return NULL;
     char *link_start = ++pr;
-    char *link_end = strchrnul(pr, ')');
-    if (*link_end == '\0') return NULL;
-    if (strchrnul(link_start, ' ') < link_end) return NULL;
-    sb_appendf(sb, "<a href=\"%.*s\">", (int) (link_end-link_start), link_start);
-    render_text_field(display_start, (size_t) (display_end-display_start), sb);
-    sb_append_cstr(sb, "</a>");
+    char *link_end = find_char(pr, end, ')');
+    if (link_end == end) return NULL;
+    if (find_char(link_start, link_end, ' ') < link_end) return NULL;
+    ctx->stats.links += 1;
+    if (ctx->plain){
+        render_text_field(display_start, display_end, ctx);
+        if (ctx->options.text_link_urls){
+            out_append_lit(ctx, " (");
+            out_append_target(ctx, link_start, link_end-link_start);
+            out_append_lit(ctx, ")");
+        }
+        return link_end;
+    }
+    out_append_lit(ctx, "<a href=\"");
+    out_append_target(ctx, link_start, link_end-link_start);
+    out_append_lit(ctx, "\">");
+    render_text_field(display_start, display_end, ctx);
+    out_append_lit(ctx, "</a>");
     return link_end;
 }
 
-char *try_render_autolink(char *pr, String_Builder *sb)
+char *try_render_autolink(char *pr, char *end, Htmd_Context *ctx)
 {
     char *link_start = ++pr;
-    char *link_end = strchrnul(pr, '>');
-    if (*link_end == '\0') return NULL;
-    sb_appendf(sb, "<a href=\"%.*s\">%.*s</a>", (int) (link_end-link_start), link_start, (int) (link_end-link_start), link_start);
+    char *link_end = find_char(pr, end, '>');
+    if (link_end == end) return NULL;
+    ctx->stats.links += 1;
+    out_tag_lit(ctx, "<a href=\"");
+    if (!ctx->plain) out_append_ref(ctx, link_start, link_end-link_start);
+    out_tag_lit(ctx, "\">");
+    out_text(ctx, link_start, link_end-link_start);
+    out_tag_lit(ctx, "</a>");
     return link_end;
 }
 
-char* try_render_image(char *pr, String_Builder *sb)
+char* try_render_image(char *pr, char *end, Htmd_Context *ctx)
 {
     char *display_start = pr+=2;
-    char *display_end = strchrnul(pr, ']');
+    char *display_end = find_char(pr, end, ']');
     pr = display_end;
-    if (*pr == '\0') return NULL;
-    if (*++pr != '(') return NULL;
+    if (pr == end) return NULL;
+    if (++pr == end || *pr != '(') return NULL;
     char *link_start = ++pr;
-    char *link_end = strchrnul(pr, ')');
-    if (*link_end == '\0') return NULL;
-    if (strchrnul(link_start, ' ') < link_end) return NULL;
-    sb_appendf(sb, "<img src=\"%.*s\" alt=\"%.*s\">", (int) (link_end-link_start), link_start, (int) (display_end-display_start), display_start);
+    char *link_end = find_char(pr, end, ')');
+    if (link_end == end) return NULL;
+    if (find_char(link_start, link_end, ' ') < link_end) return NULL;
+    ctx->stats.images += 1;
+    if (ctx->plain){
+        out_text(ctx, display_start, display_end-display_start);
+        return link_end;
+    }
+    out_append_lit(ctx, "<img src=\"");
+    out_append_target(ctx, link_start, link_end-link_start);
+    out_append_lit(ctx, "\" alt=\"");
+    out_text(ctx, display_start, display_end-display_start);
+    out_append_lit(ctx, "\">");
     return link_end;
 }
 
-void render_text_field(char *pr, size_t n, String_Builder *sb)
+void render_text_field(char *pr, char *end, Htmd_Context *ctx)
 {
     bool styles[_Style_Count] = {0};
+    // plain text without code leaves out what is between backticks
+    bool drop_code = ctx->plain && !ctx->options.text_code;
+    // a dropped code span between two spaces leaves only one of them
+    bool code_after_space = false;
+    unsigned stops = ctx->plain ? CC_INLINE | CC_ENTITY : CC_INLINE;
+    pr = skip_whitespace(pr, end);
     char *start = pr;
-    pr = skip_whitespace(pr);
     char *last = pr;
     while (true){
+        if (pr >= end){
+            if (!(drop_code && styles[Style_Code])) out_text(ctx, last, pr-last);
+            return;
+        }
+        if (!char_is(*pr, stops)){
+            pr += 1;
+            continue;
+        }
         if (*pr == '`'){
-            sb_append_buf(sb, last, pr-last);
-            sb_append_cstr(sb, styles[Style_Code]? "</code>" : "<code>");
+            if (!(drop_code && styles[Style_Code])) out_text(ctx, last, pr-last);
+            out_tag_cstr(ctx, styles[Style_Code]? "</code>" : "<code>");
             styles[Style_Code] = !styles[Style_Code];
+            ctx->stats.code_spans += styles[Style_Code];
+            if (drop_code && styles[Style_Code]) code_after_space = pr == start || pr[-1] == ' ';
+            else if (drop_code && code_after_space && pr+1 < end && pr[1] == ' ') pr += 1;
             last = ++pr;
             continue;
         }
-        if ((size_t) (pr-start) >= n){
-            sb_append_buf(sb, last, pr-last);
-            return;
+        if (*pr == '&'){
+            if (!styles[Style_Code]){
+                out_text(ctx, last, pr-last);
+                char *result = try_render_entity(pr, end, ctx);
+                if (result == NULL) out_text(ctx, pr, 1);
+                else pr = result;
+                last = pr + 1;
+            }
+            pr += 1;
+            continue;
         }
         if (!styles[Style_Code]){
-            if (starts_with(pr, "**") || starts_with(pr, "__")){
-                sb_append_buf(sb, last, pr-last);
-                sb_append_cstr(sb, styles[Style_Bold]? "</strong>" : "<strong>");
+            if (starts_with(pr, end, "**") || starts_with(pr, end, "__")){
+                out_text(ctx, last, pr-last);
+                out_tag_cstr(ctx, styles[Style_Bold]? "</strong>" : "<strong>");
                 styles[Style_Bold] = !styles[Style_Bold];
+                ctx->stats.strong += styles[Style_Bold];
                 last = pr+=2;
                 continue;
             }
-            if (starts_with(pr, "![")){
-                sb_append_buf(sb, last, pr-last);
-                char *result = try_render_image(pr, sb);
+            if (starts_with(pr, end, "![")){
+                out_text(ctx, last, pr-last);
+                char *result = try_render_image(pr, end, ctx);
                 if (result == NULL){
-                    sb_append_buf(sb, pr, 1);
+                    out_text(ctx, pr, 1);
                 }else{
                     pr = result;
                 }
@@ -211,33 +773,35 @@ void render_text_field(char *pr, size_t n, String_Builder *sb)
             switch (*pr){
                 case '*':
                 case '_':{
-                    sb_append_buf(sb, last, pr-last);
-                    sb_append_cstr(sb, styles[Style_Italic]? "</em>" : "<em>");
+                    out_text(ctx, last, pr-last);
+                    out_tag_cstr(ctx, styles[Style_Italic]? "</em>" : "<em>");
                     styles[Style_Italic] = !styles[Style_Italic];
+                    ctx->stats.emphasis += styles[Style_Italic];
                     last = ++pr;
                 }continue;
                 case '~':{
-                    sb_append_buf(sb, last, pr-last);
-                    sb_append_cstr(sb, styles[Style_Strike]? "</s>" : "<s>");
+                    out_text(ctx, last, pr-last);
+                    out_tag_cstr(ctx, styles[Style_Strike]? "</s>" : "<s>");
                     styles[Style_Strike] = !styles[Style_Strike];
+                    ctx->stats.strikethroughs += styles[Style_Strike];
                     last = ++pr;
                 }continue;
                 case '[':{
-                    sb_append_buf(sb, last, pr-last);
-                    char *result = try_render_link(pr, sb);
+                    out_text(ctx, last, pr-last);
+                    char *result = try_render_link(pr, end, ctx);
                     if (result == NULL){
-                        if (starts_with(pr, "[ ]")){
-                            sb_append_buf(sb, last, pr-last);
-                            sb_append_cstr(sb, "<input type=\"checkbox\"/>");
-                            last = pr += 2;
+                        if (starts_with(pr, end, "[ ]")){
+                            out_tag_lit(ctx, "<input type=\"checkbox\"/>");
+                            ctx->stats.checkboxes += 1;
+                            pr += 2;
                         }
-                        else if (starts_with(pr, "[x]")){
-                            sb_append_buf(sb, last, pr-last);
-                            sb_append_cstr(sb, "<input type=\"checkbox\" checked />");
-                            last = pr += 2;
+                        else if (starts_with(pr, end, "[x]")){
+                            out_tag_lit(ctx, "<input type=\"checkbox\" checked />");
+                            ctx->stats.checkboxes += 1;
+                            pr += 2;
                         }
                         else{
-                            sb_append_buf(sb, pr, 1);
+                            out_text(ctx, pr, 1);
                         }
                     }else{
                         pr = result;
@@ -245,10 +809,11 @@ void render_text_field(char *pr, size_t n, String_Builder *sb)
                     last = ++pr;
                 } continue;
                 case '<':{
-                    sb_append_buf(sb, last, pr-last);
-                    char *result = try_render_autolink(pr, sb);
+                    out_text(ctx, last, pr-last);
+                    char *result = try_render_autolink(pr, end, ctx);
                     if (result == NULL){
-                        sb_append_cstr(sb, "&lt;");
+                        out_markup_lit(ctx, "&lt;", "<");
+                        if (ctx->options.text != NULL) ctx->options.text(ctx->options.text_user, "<", 1);
                     }else{
                         pr = result;
                     }
@@ -256,8 +821,9 @@ void render_text_field(char *pr, size_t n, String_Builder *sb)
                 }continue;
                 case '\\':{
                     // escaping
-                    sb_append_buf(sb, last, pr-last);
-                    sb_append_buf(sb, ++pr, 1);
+                    out_text(ctx, last, pr-last);
+                    if (pr+1 < end) pr += 1;
+                    out_text(ctx, pr, 1);
                     last = ++pr;
                 }continue;
             }
@@ -266,187 +832,1464 @@ void render_text_field(char *pr, size_t n, String_Builder *sb)
     }
 }
 
-void render_text(char *pr, String_Builder *sb)
+uint64_t nanos_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+// entry point of the inline renderer for block level callers
+void render_inline(char *pr, char *end, Htmd_Context *ctx)
 {
-    render_text_field(pr, strlen(pr), sb);
+    if (!ctx->options.collect_stats){
+        render_text_field(pr, end, ctx);
+    }else{
+        uint64_t started = nanos_now();
+        render_text_field(pr, end, ctx);
+        ctx->stats.inline_nanos += nanos_now() - started;
+    }
+    if (ctx->options.text != NULL) ctx->options.text(ctx->options.text_user, "\n", 1);
 }
 
-void render_paragraph(char *pr, String_Builder *sb)
+void render_paragraph(char *pr, char *end, Htmd_Context *ctx)
 {
     // TODO: make this span multiple lines so that we can have proper markdown line breaks
-    sb_append_cstr(sb, "<p>");
-    render_text(pr, sb);
-    sb_append_cstr(sb, "</p>\n");
+    out_tag_lit(ctx, "<p>");
+    ctx->stats.paragraphs += 1;
+    render_inline(pr, end, ctx);
+    out_markup_lit(ctx, "</p>\n", "\n");
 }
 
-void render_header(char *pr, String_Builder *sb, size_t header_level)
+// Headings
+//
+// With heading ids every heading gets an id made from its text the way
+// GitHub does it: lowercased, spaces turned into '-', punctuation dropped.
+// Ids that are taken already get "-1", "-2", ... appended; the ids given out
+// are kept as hashes in a small open addressing set. The table of contents is
+// rendered next to the document, one entry per heading, and inserted where
+// the marker line was (or at the top) once the document is done.
+
+#define HEADING_IDS_MIN_SLOTS 64
+#define TOC_MARKER "[TOC]"
+
+void text_append_char(Htmd_Context *ctx, Buffer *buffer, char c)
 {
-    sb_appendf(sb, "<h%zu>", header_level);
-    render_text(pr+header_level, sb);
-    sb_appendf(sb, "</h%zu>\n", header_level);
+    buffer_append(ctx, buffer, &c, 1);
 }
 
-void render_html_escaped(char *pr, String_Builder *sb)
+// the text of a heading without the markup, which is what ids are made of
+void heading_text(char *pr, char *end, Htmd_Context *ctx)
 {
-    char *last = pr;
-    while (true){
-        switch (*pr){
-            case '<': {
-                sb_append_buf(sb, last, pr-last);
-                sb_append_cstr(sb, "&lt;");
-                last = ++pr;
-            }continue;
-            case '>': {
-                sb_append_buf(sb, last, pr-last);
-                sb_append_cstr(sb, "&gt;");
-                last = ++pr;
+    Buffer *text = &ctx->heading;
+    text->count = 0;
+    pr = skip_whitespace(pr, end);
+    while (end > pr && (end[-1] == ' ' || end[-1] == '\t')) --end;
+    bool code = false;
+    while (pr < end){
+        char c = *pr++;
+        if (c == '`'){
+            code = !code;
+            continue;
+        }
+        if (code){
+            text_append_char(ctx, text, c);
+            continue;
+        }
+        switch (c){
+            case '*': case '_': case '~': case '[':
+                continue;
+            case '!':{
+                if (pr < end && *pr == '[') continue;
+            }break;
+            case ']':{
+                // the target of a link or image
+                if (pr < end && *pr == '('){
+                    char *close = find_char(pr, end, ')');
+                    pr = close < end ? close + 1 : end;
+                }
             }continue;
-            case '\0':{
-                sb_appendf(sb, "%.*s\n", (int) (pr-last), last);
-            } return;
+            case '<':{
+                // autolinks show their target
+                char *close = find_char(pr, end, '>');
+                if (close < end){
+                    buffer_append(ctx, text, pr, close - pr);
+                    pr = close + 1;
+                    continue;
+                }
+            }break;
+            case '\\':{
+                if (pr < end) c = *pr++;
+            }break;
         }
-        pr += 1;
+        text_append_char(ctx, text, c);
     }
 }
 
-char* render_code_block(char *pr, char *line_buffer, size_t buffer_size, char *line_ptr, String_Builder *sb)
+// adds `hash` to the ids of the document, false if it is there already
+bool heading_ids_insert(Htmd_Context *ctx, Htmd_Hash hash)
 {
-    pr = skip_whitespace(pr) + 3;
-    pr = skip_whitespace(pr);
-    char *lang_end = find_word_end(pr);
-    if (lang_end != pr){
-        sb_appendf(sb, "<pre><code class=\"language-%.*s\">\n", (int) (lang_end-pr), pr);
-    }else{
-        sb_append_cstr(sb, "<pre><code>\n");
+    uint64_t key = hash.lo != 0 ? hash.lo : 1;
+    if (ctx->ids.slots == NULL || 2*(ctx->ids.count + 1) > ctx->ids.mask + 1){
+        size_t capacity = ctx->ids.slots == NULL ? HEADING_IDS_MIN_SLOTS : 2*(ctx->ids.mask + 1);
+        uint64_t *slots = scratch_alloc(ctx, capacity*sizeof(*slots));
+        // the id is taken as it is, the render has failed anyway
+        if (slots == NULL) return true;
+        memset(slots, 0, capacity*sizeof(*slots));
+        for (size_t i = 0; ctx->ids.slots != NULL && i <= ctx->ids.mask; ++i){
+            uint64_t old = ctx->ids.slots[i];
+            if (old == 0) continue;
+            size_t j = old & (capacity - 1);
+            while (slots[j] != 0) j = (j + 1) & (capacity - 1);
+            slots[j] = old;
+        }
+        if (ctx->ids.slots != NULL) ctx->scratch.free(ctx->scratch.user, ctx->ids.slots, (ctx->ids.mask + 1)*sizeof(*slots));
+        ctx->ids.slots = slots;
+        ctx->ids.mask = capacity - 1;
     }
-    while (true){
-        line_ptr = get_next_line(line_ptr, line_buffer, buffer_size);
-        if (line_ptr == NULL || starts_with(line_buffer, "```")) break;
-        render_html_escaped(line_buffer, sb);
+    size_t i = key & ctx->ids.mask;
+    while (ctx->ids.slots[i] != 0){
+        if (ctx->ids.slots[i] == key) return false;
+        i = (i + 1) & ctx->ids.mask;
     }
-    sb_append_cstr(sb, "</code></pre>\n");
-    return line_ptr;
+    ctx->ids.slots[i] = key;
+    ctx->ids.count += 1;
+    return true;
 }
 
-char* render_blockquote(char *pr, char *line_buffer, size_t buffer_size, char *line_ptr, String_Builder *sb)
+// makes the id of the heading in `ctx->heading`, unique in the document
+void heading_id(Htmd_Context *ctx)
 {
-    size_t last_level = 0;
-    size_t depth = 0;
-    char *next_line = line_ptr;
-    while (line_ptr != NULL){
-        pr = skip_whitespace(line_buffer);
-        size_t level = count_char(pr, '>');
-        if (level == 0) break;
-        line_ptr = next_line;
-        if (level > last_level){
-            sb_append_cstr(sb, "<blockquote>\n");
-            depth += 1;
-        }else if (level < last_level){
-            sb_append_cstr(sb, "</blockquote>\n");
-            depth -= 1;
+    Buffer *id = &ctx->heading_id;
+    id->count = 0;
+    for (size_t i = 0; i < ctx->heading.count; ++i){
+        char c = ctx->heading.items[i];
+        if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_' || c == '-' || (unsigned char) c >= 0x80){
+            text_append_char(ctx, id, c);
+        }else if (c >= 'A' && c <= 'Z'){
+            text_append_char(ctx, id, c - 'A' + 'a');
+        }else if (c == ' ' || c == '\t'){
+            text_append_char(ctx, id, '-');
         }
-        last_level = level;
-        render_text(pr+level, sb);
-        sb_append_cstr(sb, "<br>\n");
-        next_line = get_next_line(line_ptr, line_buffer, buffer_size);
     }
-    for (size_t i=0; i<depth; ++i){
-        sb_append_cstr(sb, "</blockquote>\n");
+    if (id->count == 0) buffer_append(ctx, id, "section", 7);
+    size_t base = id->count;
+    // out of memory the suffix can't be appended, and the id stays taken
+    for (size_t n = 1; !heading_ids_insert(ctx, htmd_hash(id->items, id->count)) && !ctx->stats.out_of_memory; ++n){
+        char suffix[32];
+        id->count = base;
+        buffer_append(ctx, id, suffix, snprintf(suffix, sizeof(suffix), "-%zu", n));
     }
-    
-    return line_ptr;
 }
 
-char* render_unordered_list(char *pr, char *line_buffer, size_t buffer_size, char *line_ptr, String_Builder *sb)
+void buffer_append_escaped(Htmd_Context *ctx, Buffer *buffer, const char *data, size_t size)
 {
-    // TODO: support nested lists
-    sb_append_cstr(sb, "<ul>\n");
-    while (true){
-        if (line_ptr == NULL || (pr = is_list(line_buffer)) == NULL) break;
-        sb_append_cstr(sb, "  <li>");
-        render_text(pr, sb);
-        sb_append_cstr(sb, "</li>\n");
-        line_ptr = get_next_line(line_ptr, line_buffer, buffer_size);
+    for (size_t i = 0; i < size; ++i){
+        switch (data[i]){
+            case '<': buffer_append(ctx, buffer, "&lt;", 4); break;
+            case '>': buffer_append(ctx, buffer, "&gt;", 4); break;
+            case '&': buffer_append(ctx, buffer, "&amp;", 5); break;
+            case '"': buffer_append(ctx, buffer, "&quot;", 6); break;
+            default: text_append_char(ctx, buffer, data[i]);
+        }
     }
-    sb_append_cstr(sb, "</ul>\n");
-    return line_ptr;
 }
 
-char* render_ordered_list(char *pr, char *line_buffer, size_t buffer_size, char *line_ptr, String_Builder *sb)
+#define toc_append_lit(ctx, lit) buffer_append((ctx), &(ctx)->toc, (lit), sizeof(lit)-1)
+
+// adds the current heading to the table of contents, nested in the entry
+// before it if it is of a deeper level
+void toc_add(Htmd_Context *ctx, size_t level)
 {
-    // TODO: support nested lists
-    sb_append_cstr(sb, "<ol>\n");
-    while (true){
-        if (line_ptr == NULL || (pr = is_enum(line_buffer)) == NULL) break;
-        sb_append_cstr(sb, "  <li>");
-        render_text(pr, sb);
-        sb_append_cstr(sb, "</li>\n");
-        line_ptr = get_next_line(line_ptr, line_buffer, buffer_size);
+    size_t *levels = ctx->toc_levels;
+    size_t *depth = &ctx->toc_depth;
+    if (*depth == 0){
+        toc_append_lit(ctx, "<nav class=\"toc\">\n<ul>\n");
+        levels[(*depth)++] = level;
+    }else if (level > levels[*depth-1]){
+        toc_append_lit(ctx, "\n<ul>\n");
+        levels[(*depth)++] = level;
+    }else{
+        toc_append_lit(ctx, "</li>\n");
+        while (levels[*depth-1] > level){
+            // a level between two open ones joins the deeper list
+            if (*depth == 1 || levels[*depth-2] < level){
+                levels[*depth-1] = level;
+                break;
+            }
+            *depth -= 1;
+            toc_append_lit(ctx, "</ul>\n</li>\n");
+        }
     }
-    sb_append_cstr(sb, "</ol>\n");
-    return line_ptr;
+    toc_append_lit(ctx, "  <li><a href=\"#");
+    buffer_append(ctx, &ctx->toc, ctx->heading_id.items, ctx->heading_id.count);
+    toc_append_lit(ctx, "\">");
+    buffer_append_escaped(ctx, &ctx->toc, ctx->heading.items, ctx->heading.count);
+    toc_append_lit(ctx, "</a>");
 }
 
-char* render_markdown(char *input)
+bool is_toc_marker(char *pr, char *end)
 {
-    char line_buffer[MAX_LINE_LEN+1];
-    char *line_ptr = input;
+    while (end > pr && (end[-1] == ' ' || end[-1] == '\t')) --end;
+    return (size_t) (end - pr) == sizeof(TOC_MARKER)-1 && memcmp(pr, TOC_MARKER, sizeof(TOC_MARKER)-1) == 0;
+}
+
+void toc_mark(Htmd_Context *ctx)
+{
+    ctx->toc_marked = true;
+    ctx->block_uncacheable = true;
+    if (ctx->output_mode == Output_Rope){
+        ctx->toc_at = ctx->rope.count;
+        ctx->toc_at_size = ctx->rope.count > 0 ? ctx->rope.items[ctx->rope.count-1].size : 0;
+    }else{
+        ctx->toc_at = ctx->out.count;
+    }
+}
 
-    String_Builder sb_out = {0};
-    bool last_line_empty = false;
+// closes the lists still open in the table of contents
+void toc_close(Htmd_Context *ctx)
+{
+    if (ctx->toc_depth == 0) return;
+    toc_append_lit(ctx, "</li>\n");
+    for (; ctx->toc_depth > 1; --ctx->toc_depth) toc_append_lit(ctx, "</ul>\n</li>\n");
+    ctx->toc_depth = 0;
+    toc_append_lit(ctx, "</ul>\n</nav>\n");
+}
 
-    // iterate over lines
-    while ((line_ptr = get_next_line(line_ptr, line_buffer, sizeof(line_buffer))) != NULL){
-        char *pr = line_buffer;
+// puts the finished table of contents into the output
+void toc_insert(Htmd_Context *ctx)
+{
+    if (!ctx->toc_pending) return;
+    ctx->toc_pending = false;
+    if (ctx->toc_depth == 0 || ctx->stats.out_of_memory) return;
+    toc_close(ctx);
 
-        // empty line spacing
-        if (line_is_empty(pr)){
-            if (last_line_empty){
-                sb_append_cstr(&sb_out, "\n<br>\n");
+    Buffer *toc = &ctx->toc;
+    size_t at = ctx->toc_at;
+    switch (ctx->output_mode){
+        case Output_Buffer:{
+            if (!buffer_reserve(ctx, &ctx->out, toc->count)) return;
+            memmove(ctx->out.items + at + toc->count, ctx->out.items + at, ctx->out.count - at);
+            memcpy(ctx->out.items + at, toc->items, toc->count);
+            ctx->out.count += toc->count;
+        }break;
+        case Output_Rope:{
+            // what came after the marker may have been packed onto the segment before it
+            Htmd_Segment *before = at > 0 ? &ctx->rope.items[at-1] : NULL;
+            if (before != NULL && before->size > ctx->toc_at_size){
+                const char *rest = before->data + ctx->toc_at_size;
+                size_t rest_size = before->size - ctx->toc_at_size;
+                before->size = ctx->toc_at_size;
+                rope_insert(ctx, at, rest, rest_size);
             }
-            last_line_empty = !last_line_empty;
-            continue;
-        }
-        last_line_empty = false;
-        
-        // code blocks
-        if (is_code_block(pr)){
-            line_ptr = render_code_block(pr, line_buffer, sizeof(line_buffer), line_ptr, &sb_out);
-            continue;
-        }
-        pr = skip_whitespace(pr);
+            rope_insert(ctx, at, toc->items, toc->count);
+            ctx->rope_bytes += toc->count;
+        }break;
+        case Output_Fixed:{
+            // only used without options
+        }break;
+    }
+}
 
-        // headings
-        size_t header_level = count_char(pr, '#');
-        if (header_level > 0){
-            render_header(pr, &sb_out, header_level);
-            continue;
+void render_header(char *pr, char *end, Htmd_Context *ctx, size_t header_level)
+{
+    static const char *open_tags[] = {"<h1>", "<h2>", "<h3>", "<h4>", "<h5>", "<h6>"};
+    static const char *id_tags[] = {"<h1 id=\"", "<h2 id=\"", "<h3 id=\"", "<h4 id=\"", "<h5 id=\"", "<h6 id=\""};
+    static const char *close_tags[] = {"</h1>\n", "</h2>\n", "</h3>\n", "</h4>\n", "</h5>\n", "</h6>\n"};
+    size_t tag = (header_level > 6 ? 6 : header_level) - 1;
+    bool toc = (ctx->options.toc || ctx->options.toc_apart) && !ctx->plain;
+    bool ids = ctx->options.heading_ids || ctx->options.toc || ctx->options.toc_apart;
+    if (ids || ctx->options.heading != NULL){
+        // ids depend on the headings before, so the block can't be cached
+        ctx->block_uncacheable = true;
+        heading_text(pr+header_level, end, ctx);
+        if (ids) heading_id(ctx);
+        if (ctx->options.heading != NULL){
+            ctx->options.heading(ctx->options.heading_user, tag+1,
+                                 ids ? ctx->heading_id.items : NULL, ids ? ctx->heading_id.count : 0,
+                                 ctx->heading.items, ctx->heading.count);
         }
+        if (toc) toc_add(ctx, tag+1);
+    }
+    if (ctx->plain){
+        // no tag to put the id into
+    }else if (ids){
+        out_append_cstr(ctx, id_tags[tag]);
+        out_append(ctx, ctx->heading_id.items, ctx->heading_id.count);
+        out_append_lit(ctx, "\">");
+    }else{
+        out_append_cstr(ctx, open_tags[tag]);
+    }
+    render_inline(pr+header_level, end, ctx);
+    out_markup_cstr(ctx, close_tags[tag], "\n");
+}
 
-        // seperators
-        if (starts_with(pr, "---") || starts_with(pr, "***") || starts_with(pr, "___")){
-            sb_append_cstr(&sb_out, "<hr>\n");
-            continue;
-        }
-        if (is_enum(pr)){
-            line_ptr = render_ordered_list(pr, line_buffer, sizeof(line_buffer), line_ptr, &sb_out);
-            continue;
-        }
-        
+void render_html_escaped(char *pr, char *end, Htmd_Context *ctx)
+{
+    char *last = pr;
+    for (; pr < end; ++pr){
         switch (*pr){
-            case '-':{
-                line_ptr = render_unordered_list(pr, line_buffer, sizeof(line_buffer), line_ptr, &sb_out);
-                continue;
+            case '<': {
+                out_append_ref(ctx, last, pr-last);
+                out_append_lit(ctx, "&lt;");
+                last = pr+1;
             }break;
-            case '>':{
-                line_ptr = render_blockquote(pr, line_buffer, sizeof(line_buffer), line_ptr, &sb_out);
-                continue;
+            case '>': {
+                out_append_ref(ctx, last, pr-last);
+                out_append_lit(ctx, "&gt;");
+                last = pr+1;
             }break;
         }
+    }
+    out_append_ref(ctx, last, pr-last);
+    out_append_lit(ctx, "\n");
+}
+
+// a line of a code block, or a blank one when `pr` == `end`
+void render_code_line(char *pr, char *end, Htmd_Context *ctx)
+{
+    if (!ctx->plain){
+        render_html_escaped(pr, end, ctx);
+    }else if (ctx->options.text_code){
+        out_append_ref(ctx, pr, end-pr);
+        out_append_lit(ctx, "\n");
+    }
+}
+
+
+typedef struct{
+    char *pr;
+    char *end;
+    size_t column;
+} Line;
+
+size_t line_indent_column(Line *line)
+{
+    size_t column = line->column;
+    for (char *pr = line->pr; pr < line->end; ++pr){
+        if (*pr == ' ') column += 1;
+        else if (*pr == '\t') column += TAB_WIDTH - column%TAB_WIDTH;
+        else break;
+    }
+    return column;
+}
+
+void line_consume_to_column(Line *line, size_t column)
+{
+    while (line->pr < line->end && line->column < column){
+        if (*line->pr == ' ') line->column += 1;
+        else if (*line->pr == '\t') line->column += TAB_WIDTH - line->column%TAB_WIDTH;
+        else break;
+        line->pr += 1;
+    }
+}
+
+void line_advance(Line *line, size_t n)
+{
+    line->pr += n;
+    line->column += n;
+}
+
+bool line_match_quote(Line *line)
+{
+    size_t column = line_indent_column(line);
+    if (column - line->column >= TAB_WIDTH) return false;
+    Line probe = *line;
+    line_consume_to_column(&probe, column);
+    if (probe.pr == probe.end || *probe.pr != '>') return false;
+    line_advance(&probe, 1);
+    if (probe.pr < probe.end && *probe.pr == ' ') line_advance(&probe, 1);
+    *line = probe;
+    return true;
+}
+
+// returns the end of a list marker ("-", "*", "+", "1." or "1)") at pr, or NULL
+char* list_marker(char *pr, char *end, Container_Kind *kind)
+{
+    char *marker_end = NULL;
+    if (pr < end && (*pr == '-' || *pr == '*' || *pr == '+')){
+        *kind = Container_Unordered;
+        marker_end = pr+1;
+    }else{
+        char *digits = pr;
+        while (pr < end && char_is(*pr, CC_DIGIT) && pr-digits < 9) ++pr;
+        if (pr == digits || pr == end || (*pr != '.' && *pr != ')')) return NULL;
+        *kind = Container_Ordered;
+        marker_end = pr+1;
+    }
+    if (marker_end < end && !char_is(*marker_end, CC_SPACE)) return NULL;
+    return marker_end;
+}
+
+bool is_thematic_break(char *pr, char *end)
+{
+    return starts_with(pr, end, "---") || starts_with(pr, end, "***") || starts_with(pr, end, "___");
+}
+
+// terminates the first line of a list item before a block is nested into it
+void break_item_line(Htmd_Context *ctx)
+{
+    Block_Parser *p = &ctx->parser;
+    if (p->depth == 0) return;
+    Container *top = &p->stack[p->depth-1];
+    if (top->kind != Container_Quote && top->inline_open){
+        out_append_lit(ctx, "\n");
+        top->inline_open = false;
+    }
+}
+
+// ends a list item, whose line in plain text may be ended already by what is nested in it
+void close_list_item(Htmd_Context *ctx, Container *item, const char *html)
+{
+    if (!ctx->plain) out_append_cstr(ctx, html);
+    else if (item->inline_open) out_append_lit(ctx, "\n");
+}
 
-        // render normal text line
-        render_paragraph(pr, &sb_out);
+void open_list_item(Htmd_Context *ctx, Line *line, char *marker_end, bool new_list, Container_Kind kind)
+{
+    Block_Parser *p = &ctx->parser;
+    if (new_list){
+        break_item_line(ctx);
+        out_tag_cstr(ctx, kind == Container_Ordered ? "<ol>\n" : "<ul>\n");
+        ctx->stats.lists += 1;
+        p->stack[p->depth++] = (Container) {.kind = kind};
     }
-    sb_append_null(&sb_out);
-    return sb_out.items;
+    out_tag_lit(ctx, "  <li>");
+    line_advance(line, marker_end - line->pr);
+    size_t content_column = line_indent_column(line);
+    if (content_column - line->column > TAB_WIDTH || line->pr == line->end){
+        content_column = line->column + 1;
+    }
+    line_consume_to_column(line, content_column);
+    Container *item = &p->stack[p->depth-1];
+    item->content_column = content_column;
+    item->has_text = false;
+    item->inline_open = true;
+}
+
+void close_containers(Htmd_Context *ctx, size_t depth)
+{
+    Block_Parser *p = &ctx->parser;
+    while (p->depth > depth){
+        Container *c = &p->stack[--p->depth];
+        switch (c->kind){
+            case Container_Quote:{
+                out_tag_lit(ctx, "</blockquote>\n");
+            }break;
+            case Container_Unordered:{
+                close_list_item(ctx, c, "</li>\n</ul>\n");
+            }break;
+            case Container_Ordered:{
+                close_list_item(ctx, c, "</li>\n</ol>\n");
+            }break;
+        }
+    }
+}
+
+void close_leaf(Htmd_Context *ctx)
+{
+    Block_Parser *p = &ctx->parser;
+    if (p->leaf == Leaf_None) return;
+    out_tag_lit(ctx, "</code></pre>\n");
+    p->leaf = Leaf_None;
+}
+
+void handle_blank_line(Htmd_Context *ctx)
+{
+    Block_Parser *p = &ctx->parser;
+    close_containers(ctx, 0);
+    if (ctx->plain){
+        // paragraphs are kept apart by one empty line
+        if (!p->last_line_empty) out_append_lit(ctx, "\n");
+    }else if (p->last_line_empty){
+        out_append_lit(ctx, "\n<br>\n");
+    }
+    p->last_line_empty = !p->last_line_empty;
+}
+
+void open_code_block(Htmd_Context *ctx, char *pr, char *end)
+{
+    Block_Parser *p = &ctx->parser;
+    break_item_line(ctx);
+    pr = skip_whitespace(pr+3, end);
+    char *lang_end = find_word_end(pr, end);
+    if (ctx->plain){
+        // the language is markup as well
+    }else if (lang_end != pr){
+        out_append_lit(ctx, "<pre><code class=\"language-");
+        out_append_ref(ctx, pr, lang_end-pr);
+        out_append_lit(ctx, "\">\n");
+    }else{
+        out_append_lit(ctx, "<pre><code>\n");
+    }
+    p->leaf = Leaf_Fenced_Code;
+    ctx->stats.code_blocks += 1;
+}
+
+void render_rule(Htmd_Context *ctx)
+{
+    out_tag_lit(ctx, "<hr>\n");
+    ctx->stats.rules += 1;
+}
+
+void render_leaf(Htmd_Context *ctx, Line *line)
+{
+    Block_Parser *p = &ctx->parser;
+    Container *top = p->depth > 0 ? &p->stack[p->depth-1] : NULL;
+
+    // indented code blocks
+    if (line_indent_column(line) - line->column >= TAB_WIDTH){
+        break_item_line(ctx);
+        out_tag_lit(ctx, "<pre><code>\n");
+        line_consume_to_column(line, line->column + TAB_WIDTH);
+        render_code_line(line->pr, line->end, ctx);
+        p->leaf = Leaf_Indented_Code;
+        ctx->stats.code_blocks += 1;
+        return;
+    }
+    char *pr = skip_whitespace(line->pr, line->end);
+    char *end = line->end;
+
+    // code blocks
+    if (starts_with(pr, end, "```")){
+        open_code_block(ctx, pr, end);
+        return;
+    }
+
+    // headings
+    size_t header_level = count_char(pr, end, '#');
+    if (header_level > 0){
+        break_item_line(ctx);
+        render_header(pr, end, ctx, header_level);
+        ctx->stats.headings += 1;
+        return;
+    }
+
+    // seperators
+    if (is_thematic_break(pr, end)){
+        break_item_line(ctx);
+        render_rule(ctx);
+        return;
+    }
+
+    if (top == NULL && ctx->toc_pending && !ctx->toc_marked && is_toc_marker(pr, end)){
+        toc_mark(ctx);
+        return;
+    }
+
+    // text lines take their shape from the innermost container
+    if (top == NULL){
+        render_paragraph(pr, end, ctx);
+    }else if (top->kind == Container_Quote){
+        render_inline(pr, end, ctx);
+        out_markup_lit(ctx, "<br>\n", "\n");
+    }else if (pr < end){
+        if (top->has_text) out_append_lit(ctx, "\n");
+        render_inline(pr, end, ctx);
+        top->has_text = true;
+        top->inline_open = true;
+    }
+}
+
+// Front matter
+//
+// A document may start with metadata: "key: value" lines between two "---"
+// lines (the closing one may be "..." as well), as static site generators
+// use it. It isn't rendered, its pairs are kept as spans into the input.
+// Until the closing line arrives the lines are held back, and when a blank
+// line, a line that isn't a pair or the end of the document comes first they
+// are rendered as markdown after all, so documents starting with a thematic
+// break stay as they were.
+
+#define META_MIN_CAPACITY 16
+
+// a line of just "---", or "..." when it is the closing one
+bool is_front_matter_fence(char *pr, char *end, bool closing)
+{
+    if (!starts_with(pr, end, "---") && !(closing && starts_with(pr, end, "..."))) return false;
+    return skip_whitespace(pr + 3, end) == end;
+}
+
+bool is_meta_key_char(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-';
+}
+
+// the ':' after the key of a "key: value" line, NULL when it isn't one
+char* meta_colon(char *pr, char *end)
+{
+    char *key_end = pr;
+    while (key_end < end && is_meta_key_char(*key_end)) key_end += 1;
+    if (key_end == pr) return NULL;
+    char *colon = skip_whitespace(key_end, end);
+    return colon < end && *colon == ':' ? colon : NULL;
+}
+
+void meta_add(Htmd_Context *ctx, char *pr, char *end)
+{
+    char *colon = meta_colon(pr, end);
+    // rendering into a fixed buffer allocates nothing, so the pairs aren't kept
+    if (ctx->output_mode == Output_Fixed) return;
+    char *key_end = pr;
+    while (is_meta_key_char(*key_end)) key_end += 1;
+    char *value = skip_whitespace(colon + 1, end);
+    char *value_end = end;
+    while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end -= 1;
+    if (value_end - value >= 2 && (*value == '"' || *value == '\'') && value_end[-1] == *value){
+        value += 1;
+        value_end -= 1;
+    }
+    if (ctx->meta.count == ctx->meta.capacity){
+        size_t capacity = ctx->meta.capacity == 0 ? META_MIN_CAPACITY : 2*ctx->meta.capacity;
+        Htmd_Meta *items = scratch_realloc(ctx, ctx->meta.items, ctx->meta.capacity*sizeof(Htmd_Meta), capacity*sizeof(Htmd_Meta));
+        if (items == NULL) return;
+        ctx->meta.items = items;
+        ctx->meta.capacity = capacity;
+    }
+    ctx->meta.items[ctx->meta.count++] = (Htmd_Meta) {
+        .key = pr,
+        .key_size = key_end - pr,
+        .value = value,
+        .value_size = value_end - value,
+    };
+}
+
+// Holds a line back and returns where it is kept: in the input when the
+// render has all of it, else in a copy, as the chunks given to htmd_feed()
+// may go away before the render is done. NULL when out of memory.
+char* front_matter_hold(Htmd_Context *ctx, char *start, char *end)
+{
+    if (ctx->front_matter_known) return start;
+    size_t size = end - start;
+    if (!ctx->input_kept){
+        char *copy = scratch_alloc(ctx, size + 1);
+        if (copy == NULL) return NULL;
+        memcpy(copy, start, size);
+        start = copy;
+    }
+    if (ctx->held.count == ctx->held.capacity){
+        size_t capacity = ctx->held.capacity == 0 ? META_MIN_CAPACITY : 2*ctx->held.capacity;
+        Htmd_Segment *items = scratch_realloc(ctx, ctx->held.items, ctx->held.capacity*sizeof(Htmd_Segment), capacity*sizeof(Htmd_Segment));
+        if (items == NULL) return NULL;
+        ctx->held.items = items;
+        ctx->held.capacity = capacity;
+    }
+    ctx->held.items[ctx->held.count++] = (Htmd_Segment) {.data = start, .size = size};
+    return start;
+}
+
+// Takes the line while the front matter may still be open and returns whether
+// it belonged to it. When it ends the front matter before the closing line
+// the held back lines are to be rendered, see front_matter_release().
+bool front_matter_line(Htmd_Context *ctx, char *start, char *end)
+{
+    Block_Parser *p = &ctx->parser;
+    switch (p->front_matter){
+        case Front_Matter_Maybe:{
+            if (!is_front_matter_fence(start, end, false)){
+                p->front_matter = Front_Matter_Done;
+                return false;
+            }
+            p->front_matter = Front_Matter_Fence;
+            front_matter_hold(ctx, start, end);
+            return true;
+        }
+        case Front_Matter_Fence:
+        case Front_Matter_Open:{
+            if (p->front_matter == Front_Matter_Open && is_front_matter_fence(start, end, true)){
+                p->front_matter = Front_Matter_Done;
+                ctx->held.count = 0;
+                return true;
+            }
+            if (meta_colon(start, end) == NULL){
+                p->front_matter = Front_Matter_Done;
+                ctx->meta.count = 0;
+                return false;
+            }
+            p->front_matter = Front_Matter_Open;
+            char *held = front_matter_hold(ctx, start, end);
+            if (held != NULL) meta_add(ctx, held, held + (end - start));
+            return true;
+        }
+        case Front_Matter_Done: break;
+    }
+    return false;
+}
+
+void parse_line(Htmd_Context *ctx, char *start, char *end);
+
+// renders the lines held back for a front matter that wasn't one
+void front_matter_release(Htmd_Context *ctx)
+{
+    ctx->parser.front_matter = Front_Matter_Done;
+    ctx->meta.count = 0;
+    size_t lines = ctx->stats.lines;
+    // the document starts with them, which the link function is told
+    for (size_t i = 0; i < ctx->held.count; ++i){
+        ctx->stats.lines = i + 1;
+        char *line = (char*) ctx->held.items[i].data;
+        parse_line(ctx, line, line + ctx->held.items[i].size);
+    }
+    ctx->stats.lines = lines;
+    ctx->held.count = 0;
+}
+
+// whether the document starts with front matter that is closed
+bool front_matter_closes(const char *input, size_t len)
+{
+    char *pr = (char*) input;
+    char *end = pr + len;
+    for (size_t n = 0; pr < end; ++n){
+        char *line_end = find_char(pr, end, '\n');
+        char *content_end = line_end > pr && line_end[-1] == '\r' ? line_end - 1 : line_end;
+        if (n == 0 && !is_front_matter_fence(pr, content_end, false)) return false;
+        if (n > 1 && is_front_matter_fence(pr, content_end, true)) return true;
+        if (n > 0 && meta_colon(pr, content_end) == NULL) return false;
+        pr = line_end + 1;
+    }
+    return false;
+}
+
+// collects the front matter of a document whose HTML is known already
+void front_matter_scan(Htmd_Context *ctx, const char *input, size_t len)
+{
+    char *pr = (char*) input;
+    char *end = pr + len;
+    while (pr < end && ctx->parser.front_matter != Front_Matter_Done){
+        char *line_end = find_char(pr, end, '\n');
+        char *content_end = line_end > pr && line_end[-1] == '\r' ? line_end - 1 : line_end;
+        if (!front_matter_line(ctx, pr, content_end)) break;
+        pr = line_end + 1;
+    }
+    if (ctx->parser.front_matter != Front_Matter_Done) ctx->meta.count = 0;
+    ctx->parser.front_matter = Front_Matter_Done;
+    ctx->held.count = 0;
+}
+
+void parse_line(Htmd_Context *ctx, char *start, char *end)
+{
+    Block_Parser *p = &ctx->parser;
+    if (end > start && end[-1] == '\r') --end;
+    Line line = {.pr = start, .end = end, .column = 0};
+
+    if (p->front_matter != Front_Matter_Done){
+        if (front_matter_line(ctx, start, end)) return;
+        front_matter_release(ctx);
+    }
+
+    // empty line spacing
+    if (skip_whitespace(start, end) == end){
+        switch (p->leaf){
+            case Leaf_Fenced_Code:{
+                render_code_line(end, end, ctx);
+            }break;
+            case Leaf_Indented_Code:{
+                p->pending_blanks += 1;
+            }break;
+            case Leaf_None:{
+                handle_blank_line(ctx);
+            }break;
+        }
+        return;
+    }
+    p->last_line_empty = false;
+
+    // continue the open containers
+    size_t matched = 0;
+    for (; matched < p->depth; ++matched){
+        Container *c = &p->stack[matched];
+        if (c->kind == Container_Quote){
+            if (!line_match_quote(&line)) break;
+        }else{
+            if (line_indent_column(&line) < c->content_column) break;
+            line_consume_to_column(&line, c->content_column);
+        }
+    }
+
+    // lines inside an open code block
+    if (p->leaf != Leaf_None && matched == p->depth){
+        if (p->leaf == Leaf_Fenced_Code){
+            if (starts_with(skip_whitespace(line.pr, end), end, "```")){
+                close_leaf(ctx);
+            }else{
+                render_code_line(line.pr, end, ctx);
+            }
+            return;
+        }
+        if (line_indent_column(&line) - line.column >= TAB_WIDTH){
+            for (; p->pending_blanks > 0; --p->pending_blanks) render_code_line(end, end, ctx);
+            line_consume_to_column(&line, line.column + TAB_WIDTH);
+            render_code_line(line.pr, end, ctx);
+            return;
+        }
+    }
+    if (p->leaf != Leaf_None){
+        close_leaf(ctx);
+        if (p->pending_blanks > 0){
+            // the held back blank lines ended the code block, so they end the containers as well
+            size_t blanks = p->pending_blanks;
+            p->pending_blanks = 0;
+            for (size_t i=0; i<blanks; ++i) handle_blank_line(ctx);
+            parse_line(ctx, start, end);
+            return;
+        }
+    }
+
+    // a marker left of the item's content starts the next item of an open list
+    Container_Kind kind;
+    if (matched < p->depth && p->stack[matched].kind != Container_Quote){
+        size_t column = line_indent_column(&line);
+        Line probe = line;
+        line_consume_to_column(&probe, column);
+        char *marker_end = NULL;
+        if (column - line.column < TAB_WIDTH && !is_thematic_break(probe.pr, end)){
+            marker_end = list_marker(probe.pr, end, &kind);
+        }
+        if (marker_end != NULL && kind == p->stack[matched].kind){
+            close_containers(ctx, matched+1);
+            close_list_item(ctx, &p->stack[matched], "</li>\n");
+            line = probe;
+            open_list_item(ctx, &line, marker_end, false, kind);
+            matched += 1;
+        }
+    }
+    close_containers(ctx, matched);
+
+    // open new containers
+    while (p->depth < MAX_NESTING_DEPTH){
+        size_t column = line_indent_column(&line);
+        if (column - line.column >= TAB_WIDTH) break;
+        Line probe = line;
+        line_consume_to_column(&probe, column);
+        if (probe.pr < end && *probe.pr == '>'){
+            break_item_line(ctx);
+            line_match_quote(&line);
+            out_tag_lit(ctx, "<blockquote>\n");
+            ctx->stats.blockquotes += 1;
+            p->stack[p->depth++] = (Container) {.kind = Container_Quote};
+            continue;
+        }
+        if (is_thematic_break(probe.pr, end)) break;
+        char *marker_end = list_marker(probe.pr, end, &kind);
+        if (marker_end == NULL) break;
+        line = probe;
+        open_list_item(ctx, &line, marker_end, true, kind);
+    }
+
+    render_leaf(ctx, &line);
+}
+
+void finish_blocks(Htmd_Context *ctx)
+{
+    Block_Parser *p = &ctx->parser;
+    if (p->front_matter != Front_Matter_Done) front_matter_release(ctx);
+    close_leaf(ctx);
+    p->pending_blanks = 0;
+    close_containers(ctx, 0);
+    toc_insert(ctx);
+}
+
+// Hashing
+//
+// 128 bits so that a matching hash can stand in for comparing the content.
+// Not cryptographic: 16 bytes per step, each folded in by a 64x64->128 bit
+// multiply.
+
+#define HASH_P0 0xa0761d6478bd642full
+#define HASH_P1 0xe7037ed1a0b428dbull
+#define HASH_P2 0x8ebc6af09c88c6e3ull
+#define HASH_P3 0x589965cc75374cc3ull
+
+uint64_t hash_mix(uint64_t a, uint64_t b)
+{
+    __uint128_t r = (__uint128_t) a*b;
+    return (uint64_t) r ^ (uint64_t) (r >> 64);
+}
+
+uint64_t hash_read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+Htmd_Hash htmd_hash(const void *data, size_t size)
+{
+    const unsigned char *p = data;
+    uint64_t h1 = HASH_P0 ^ size;
+    uint64_t h2 = HASH_P1 ^ (size << 32 | size >> 32);
+    size_t n = size;
+    while (n >= 16){
+        uint64_t a = hash_read64(p);
+        uint64_t b = hash_read64(p + 8);
+        h1 = hash_mix(a ^ h1, b ^ HASH_P2);
+        h2 = hash_mix(b ^ h2, a ^ HASH_P3);
+        p += 16;
+        n -= 16;
+    }
+    if (n > 0){
+        unsigned char tail[16] = {0};
+        memcpy(tail, p, n);
+        uint64_t a = hash_read64(tail);
+        uint64_t b = hash_read64(tail + 8);
+        h1 = hash_mix(a ^ h1, b ^ HASH_P2);
+        h2 = hash_mix(b ^ h2, a ^ HASH_P3);
+    }
+    uint64_t lo = hash_mix(h1 ^ HASH_P3, h2 ^ HASH_P0);
+    uint64_t hi = hash_mix(h2 ^ HASH_P2, lo ^ HASH_P1);
+    return (Htmd_Hash) {.lo = lo, .hi = hi};
+}
+
+// Fragment tables
+//
+// Rendered HTML keyed by the hash of its markdown, bounded by a byte budget.
+// Entries are evicted with the CLOCK algorithm: a hit only sets the entry's
+// `referenced` bit, and the hand sweeping over the entries gives every
+// referenced entry a second chance before evicting it.
+
+#define FRAGMENT_MIN_BUCKETS 64
+
+size_t fragment_cost(size_t size)
+{
+    return sizeof(Fragment) + size;
+}
+
+Fragment** fragment_bucket(Fragment **buckets, size_t bucket_count, Htmd_Hash key)
+{
+    return &buckets[key.lo & (bucket_count - 1)];
+}
+
+bool fragment_table_init(Fragment_Table *table, size_t budget)
+{
+    *table = (Fragment_Table) {.budget = budget, .bucket_count = FRAGMENT_MIN_BUCKETS};
+    table->buckets = calloc(table->bucket_count, sizeof(*table->buckets));
+    return table->buckets != NULL;
+}
+
+void fragment_table_free(Fragment_Table *table)
+{
+    for (size_t i = 0; i < table->count; ++i) free(table->clock[i]);
+    free(table->clock);
+    free(table->buckets);
+    *table = (Fragment_Table) {0};
+}
+
+Fragment* fragment_find(Fragment_Table *table, Htmd_Hash key)
+{
+    for (Fragment *f = *fragment_bucket(table->buckets, table->bucket_count, key); f != NULL; f = f->next){
+        if (f->key.lo == key.lo && f->key.hi == key.hi) return f;
+    }
+    return NULL;
+}
+
+void fragment_grow_buckets(Fragment_Table *table)
+{
+    size_t bucket_count = table->bucket_count*2;
+    Fragment **buckets = calloc(bucket_count, sizeof(*buckets));
+    if (buckets == NULL) return;
+    for (size_t i = 0; i < table->count; ++i){
+        Fragment *f = table->clock[i];
+        Fragment **bucket = fragment_bucket(buckets, bucket_count, f->key);
+        f->next = *bucket;
+        *bucket = f;
+    }
+    free(table->buckets);
+    table->buckets = buckets;
+    table->bucket_count = bucket_count;
+}
+
+void fragment_evict(Fragment_Table *table)
+{
+    for (;;){
+        if (table->hand >= table->count) table->hand = 0;
+        Fragment *f = table->clock[table->hand];
+        if (f->referenced){
+            f->referenced = false;
+            table->hand += 1;
+            continue;
+        }
+        Fragment **link = fragment_bucket(table->buckets, table->bucket_count, f->key);
+        while (*link != f) link = &(*link)->next;
+        *link = f->next;
+        table->bytes -= fragment_cost(f->size);
+        table->clock[table->hand] = table->clock[--table->count];
+        table->evictions += 1;
+        free(f);
+        return;
+    }
+}
+
+Fragment* fragment_alloc(Htmd_Hash key, size_t size)
+{
+    Fragment *f = malloc(sizeof(Fragment) + size);
+    if (f != NULL) *f = (Fragment) {.key = key, .size = size};
+    return f;
+}
+
+void fragment_insert(Fragment_Table *table, Fragment *fragment)
+{
+    size_t cost = fragment_cost(fragment->size);
+    if (cost > table->budget || fragment_find(table, fragment->key) != NULL){
+        free(fragment);
+        return;
+    }
+    while (table->bytes + cost > table->budget) fragment_evict(table);
+
+    if (table->count == table->capacity){
+        size_t capacity = table->capacity == 0 ? FRAGMENT_MIN_BUCKETS : table->capacity*2;
+        Fragment **clock = realloc(table->clock, capacity*sizeof(*clock));
+        if (clock == NULL){
+            free(fragment);
+            return;
+        }
+        table->clock = clock;
+        table->capacity = capacity;
+    }
+    if (table->count >= table->bucket_count) fragment_grow_buckets(table);
+
+    Fragment **bucket = fragment_bucket(table->buckets, table->bucket_count, fragment->key);
+    fragment->next = *bucket;
+    *bucket = fragment;
+    table->clock[table->count++] = fragment;
+    table->bytes += cost;
+    table->insertions += 1;
+}
+
+// Push parsing
+//
+// Lines are handed to the block parser as soon as their newline arrives. Only
+// a line that is cut by a chunk boundary is copied (into `carry`), and the
+// rendered HTML is passed to the writer after every chunk, so memory use is
+// bounded by the longest line rather than by the document.
+
+#define FLUSH_THRESHOLD (64*1024)
+
+void htmd_flush(Htmd_Context *ctx)
+{
+    // the buffer only ever shrinks here, so this sees its high-water mark
+    if (ctx->out.count > ctx->stats.peak_output_size) ctx->stats.peak_output_size = ctx->out.count;
+    if (ctx->options.write == NULL || ctx->out.count == 0 || ctx->toc_pending) return;
+    ctx->options.write(ctx->options.user, ctx->out.items, ctx->out.count);
+    ctx->flushed_bytes += ctx->out.count;
+    ctx->out.count = 0;
+}
+
+void htmd_parse_line(Htmd_Context *ctx, char *start, char *end)
+{
+    ctx->stats.lines += 1;
+    if (ctx->options.collect_stats){
+        uint64_t started = nanos_now();
+        parse_line(ctx, start, end);
+        ctx->parse_nanos += nanos_now() - started;
+    }else{
+        parse_line(ctx, start, end);
+    }
+    if (ctx->out.count >= FLUSH_THRESHOLD && !ctx->hold_output) htmd_flush(ctx);
+}
+
+// Block cache
+//
+// A block is a run of lines up to and including a blank line that starts and
+// ends with no container or code block open. Its HTML then only depends on its
+// own text, so it can be reused wherever the same text appears. Next to the
+// HTML a fragment keeps the block's element counts for the stats.
+
+struct Htmd_Block_Cache{
+    Fragment_Table table;
+};
+
+Htmd_Block_Cache* htmd_block_cache_create(size_t max_bytes)
+{
+    Htmd_Block_Cache *cache = malloc(sizeof(*cache));
+    if (cache == NULL) return NULL;
+    if (!fragment_table_init(&cache->table, max_bytes)){
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void htmd_block_cache_destroy(Htmd_Block_Cache *cache)
+{
+    if (cache == NULL) return;
+    fragment_table_free(&cache->table);
+    free(cache);
+}
+
+#define STATS_COUNTS(X) \
+    X(lines) X(headings) X(paragraphs) X(lists) X(code_blocks) X(blockquotes) X(rules) \
+    X(strong) X(emphasis) X(code_spans) X(strikethroughs) X(links) X(images) X(checkboxes)
+
+void stats_count_delta(Htmd_Stats *delta, const Htmd_Stats *before, const Htmd_Stats *after)
+{
+    *delta = (Htmd_Stats) {0};
+#define X(field) delta->field = after->field - before->field;
+    STATS_COUNTS(X)
+#undef X
+}
+
+void stats_add_counts(Htmd_Stats *stats, const Htmd_Stats *delta)
+{
+#define X(field) stats->field += delta->field;
+    STATS_COUNTS(X)
+#undef X
+}
+
+// The caches go by the markdown and by the options that change its output,
+// so contexts that render differently can share them.
+Htmd_Hash cache_variant(const Htmd_Options *options)
+{
+    uint64_t fields[] = {
+        options->format,
+        options->text_link_urls,
+        options->text_code,
+        options->heading_ids,
+        options->toc,
+        options->toc_apart,
+        // blocks with headings aren't stored while it is set, so they are never taken either
+        options->heading != NULL,
+        (uintptr_t) options->link,
+        (uintptr_t) options->link_user,
+    };
+    return htmd_hash(fields, sizeof(fields));
+}
+
+Htmd_Hash htmd_cache_key(Htmd_Context *ctx, const char *input, size_t len)
+{
+    Htmd_Hash key = htmd_hash(input, len);
+    key.lo ^= ctx->cache_variant.lo;
+    key.hi ^= ctx->cache_variant.hi;
+    return key;
+}
+
+bool htmd_cacheable(Htmd_Context *ctx)
+{
+    const Htmd_Options *options = &ctx->options;
+    return options->link == NULL && options->heading == NULL && options->text == NULL && !options->toc_apart;
+}
+
+bool parser_is_idle(Block_Parser *p)
+{
+    return p->depth == 0 && p->leaf == Leaf_None && p->pending_blanks == 0 && p->front_matter == Front_Matter_Done;
+}
+
+bool line_is_blank(char *pr, char *end)
+{
+    if (end > pr && end[-1] == '\r') --end;
+    return skip_whitespace(pr, end) == end;
+}
+
+// renders the block starting at `start`, from the cache when possible, and
+// returns where the next line starts
+char* render_block_cached(Htmd_Context *ctx, Htmd_Block_Cache *cache, char *start, char *end)
+{
+    char *block_end = start;
+    bool ends_blank = false;
+    while (block_end < end && !ends_blank){
+        char *line_end = find_char(block_end, end, '\n');
+        ends_blank = line_is_blank(block_end, line_end);
+        block_end = line_end < end ? line_end + 1 : end;
+    }
+
+    Htmd_Hash key = htmd_cache_key(ctx, start, block_end - start);
+    Fragment *hit = fragment_find(&cache->table, key);
+    if (hit != NULL){
+        Htmd_Stats delta;
+        memcpy(&delta, hit->data, sizeof(delta));
+        hit->referenced = true;
+        stats_add_counts(&ctx->stats, &delta);
+        ctx->stats.block_cache_hits += 1;
+        // a block from the cache ends the same way it did when it was rendered
+        ctx->parser.last_line_empty = ends_blank;
+        out_append(ctx, hit->data + sizeof(delta), hit->size - sizeof(delta));
+        if (ctx->out.count >= FLUSH_THRESHOLD && !ctx->hold_output) htmd_flush(ctx);
+        return block_end;
+    }
+    ctx->stats.block_cache_misses += 1;
+
+    Htmd_Stats before = ctx->stats;
+    size_t out_start = ctx->out.count;
+    size_t flushed = ctx->flushed_bytes;
+    ctx->block_uncacheable = false;
+    char *line = start;
+    while (line < block_end){
+        char *line_end = find_char(line, block_end, '\n');
+        htmd_parse_line(ctx, line, line_end);
+        line = line_end + 1;
+    }
+    // a block that leaves something open, whose HTML already went to the
+    // writer or depends on the rest of the document can't be stored
+    if (!parser_is_idle(&ctx->parser) || ctx->flushed_bytes != flushed || ctx->block_uncacheable) return block_end;
+
+    size_t html_size = ctx->out.count - out_start;
+    Fragment *fragment = fragment_alloc(key, sizeof(Htmd_Stats) + html_size);
+    if (fragment == NULL) return block_end;
+    Htmd_Stats delta;
+    stats_count_delta(&delta, &before, &ctx->stats);
+    memcpy(fragment->data, &delta, sizeof(delta));
+    memcpy(fragment->data + sizeof(delta), ctx->out.items + out_start, html_size);
+    fragment_insert(&cache->table, fragment);
+    return block_end;
+}
+
+// parses a document that is completely in memory, straight out of the input
+void render_document(Htmd_Context *ctx, const char *input, size_t len)
+{
+    ctx->stats.input_bytes = len;
+    ctx->input_kept = true;
+    // with all of the input at hand whether there is front matter is known
+    // up front, so no line has to be held back
+    ctx->front_matter_known = true;
+    if (!front_matter_closes(input, len)) ctx->parser.front_matter = Front_Matter_Done;
+    char *end = (char*) input + len;
+    char *line = (char*) input;
+    // ropes and fixed buffers don't keep their output in one place to copy from,
+    // and cached blocks would skip the text hook
+    Htmd_Block_Cache *cache = ctx->output_mode == Output_Buffer && ctx->options.text == NULL ? ctx->options.block_cache : NULL;
+    while (line < end){
+        char *line_end = find_char(line, end, '\n');
+        if (cache != NULL && parser_is_idle(&ctx->parser) && !line_is_blank(line, line_end)){
+            line = render_block_cached(ctx, cache, line, end);
+            continue;
+        }
+        htmd_parse_line(ctx, line, line_end);
+        line = line_end + 1;
+    }
+    finish_blocks(ctx);
+}
+
+void htmd_init(Htmd_Context *ctx, const Htmd_Options *options)
+{
+    *ctx = (Htmd_Context) {0};
+    if (options != NULL) ctx->options = *options;
+    ctx->allocator = ctx->options.allocator != NULL ? *ctx->options.allocator : libc_allocator;
+    ctx->own_arena.parent = ctx->options.allocator;
+    ctx->scratch = htmd_arena_allocator(ctx->options.arena != NULL ? ctx->options.arena : &ctx->own_arena);
+    ctx->plain = ctx->options.format == Htmd_Format_Text;
+    ctx->cache_variant = cache_variant(&ctx->options);
+}
+
+Htmd_Context* htmd_create(const Htmd_Options *options)
+{
+    const Htmd_Allocator *allocator = options != NULL && options->allocator != NULL ? options->allocator : &libc_allocator;
+    Htmd_Context *ctx = allocator->alloc(allocator->user, sizeof(*ctx));
+    if (ctx == NULL) return NULL;
+    htmd_init(ctx, options);
+    return ctx;
+}
+
+void htmd_destroy(Htmd_Context *ctx)
+{
+    if (ctx == NULL) return;
+    Htmd_Allocator allocator = ctx->allocator;
+    htmd_arena_release(&ctx->own_arena);
+    allocator.free(allocator.user, ctx, sizeof(*ctx));
+}
+
+void htmd_begin(Htmd_Context *ctx)
+{
+    // the previous render's memory goes away in one step; a caller supplied
+    // arena is reset by its owner
+    if (ctx->options.arena == NULL) htmd_arena_reset(&ctx->own_arena);
+    ctx->out = (Buffer) {0};
+    ctx->carry = (Buffer) {0};
+    ctx->output_mode = Output_Buffer;
+    ctx->rope.items = NULL;
+    ctx->rope.count = 0;
+    ctx->rope.capacity = 0;
+    ctx->rope_bytes = 0;
+    ctx->rope_chunk = NULL;
+    ctx->rope_chunk_size = 0;
+    ctx->rope_chunk_used = 0;
+    ctx->parser = (Block_Parser) {0};
+    ctx->stats = (Htmd_Stats) {0};
+    ctx->parse_nanos = 0;
+    ctx->flushed_bytes = 0;
+    ctx->hold_output = false;
+    ctx->block_uncacheable = false;
+    ctx->input_kept = false;
+    ctx->front_matter_known = false;
+    ctx->heading = (Buffer) {0};
+    ctx->heading_id = (Buffer) {0};
+    ctx->ids.slots = NULL;
+    ctx->ids.mask = 0;
+    ctx->ids.count = 0;
+    ctx->toc = (Buffer) {0};
+    ctx->toc_depth = 0;
+    ctx->toc_pending = ctx->options.toc && !ctx->plain;
+    ctx->toc_marked = false;
+    ctx->toc_at = 0;
+    ctx->toc_at_size = 0;
+    ctx->meta.items = NULL;
+    ctx->meta.count = 0;
+    ctx->meta.capacity = 0;
+    ctx->held.items = NULL;
+    ctx->held.count = 0;
+    ctx->held.capacity = 0;
+}
+
+void htmd_feed(Htmd_Context *ctx, const char *buf, size_t len)
+{
+    char *pr = (char*) buf;
+    char *end = pr + len;
+    ctx->stats.input_bytes += len;
+    if (ctx->carry.count > 0){
+        char *line_end = find_char(pr, end, '\n');
+        buffer_append(ctx, &ctx->carry, pr, line_end-pr);
+        if (line_end == end) return;
+        htmd_parse_line(ctx, ctx->carry.items, ctx->carry.items + ctx->carry.count);
+        ctx->carry.count = 0;
+        pr = line_end + 1;
+    }
+    while (pr < end){
+        char *line_end = find_char(pr, end, '\n');
+        if (line_end == end){
+            buffer_append(ctx, &ctx->carry, pr, end-pr);
+            break;
+        }
+        htmd_parse_line(ctx, pr, line_end);
+        pr = line_end + 1;
+    }
+    htmd_flush(ctx);
+}
+
+bool htmd_finish(Htmd_Context *ctx)
+{
+    if (ctx->carry.count > 0){
+        htmd_parse_line(ctx, ctx->carry.items, ctx->carry.items + ctx->carry.count);
+        ctx->carry.count = 0;
+    }
+    finish_blocks(ctx);
+    htmd_flush(ctx);
+    return !ctx->stats.out_of_memory;
+}
+
+const char* htmd_output(Htmd_Context *ctx, size_t *size)
+{
+    if (size != NULL) *size = ctx->out.count;
+    return ctx->out.items;
+}
+
+const char* htmd_render(Htmd_Context *ctx, const char *input, size_t len, size_t *size)
+{
+    htmd_begin(ctx);
+    // HTML is usually a bit larger than its markdown, so one reservation
+    // sized from the input covers most documents without growing
+    if (ctx->options.write == NULL) buffer_reserve(ctx, &ctx->out, len + len/2 + 256);
+    if (ctx->options.block_cache != NULL){
+        render_document(ctx, input, len);
+        htmd_flush(ctx);
+    }else{
+        ctx->input_kept = true;
+        htmd_feed(ctx, input, len);
+        htmd_finish(ctx);
+    }
+    if (ctx->stats.out_of_memory){
+        if (size != NULL) *size = 0;
+        return NULL;
+    }
+    return htmd_output(ctx, size);
+}
+
+void htmd_render_held(Htmd_Context *ctx, const char *input, size_t len)
+{
+    htmd_begin(ctx);
+    buffer_reserve(ctx, &ctx->out, len + len/2 + 256);
+    ctx->hold_output = true;
+    render_document(ctx, input, len);
+    ctx->hold_output = false;
+}
+
+void htmd_render_copy(Htmd_Context *ctx, const char *input, size_t len, const char *html, size_t size)
+{
+    htmd_begin(ctx);
+    ctx->input_kept = true;
+    front_matter_scan(ctx, input, len);
+    ctx->stats.input_bytes = len;
+    ctx->toc_pending = false;
+    out_append(ctx, html, size);
+}
+
+Htmd_Rope htmd_render_rope(Htmd_Context *ctx, const char *input, size_t len)
+{
+    htmd_begin(ctx);
+    ctx->output_mode = Output_Rope;
+    render_document(ctx, input, len);
+    if (ctx->stats.out_of_memory) return (Htmd_Rope) {0};
+    return (Htmd_Rope) {.items = ctx->rope.items, .count = ctx->rope.count, .size = ctx->rope_bytes};
+}
+
+const Htmd_Meta* htmd_front_matter(Htmd_Context *ctx, size_t *count)
+{
+    *count = ctx->meta.count;
+    return ctx->meta.items;
+}
+
+const char* htmd_toc(Htmd_Context *ctx, size_t *size)
+{
+    toc_close(ctx);
+    *size = ctx->toc.count;
+    return ctx->toc.items;
+}
+
+const char* htmd_meta(Htmd_Context *ctx, const char *key, size_t *size)
+{
+    size_t key_size = strlen(key);
+    for (size_t i = 0; i < ctx->meta.count; ++i){
+        const Htmd_Meta *meta = &ctx->meta.items[i];
+        if (meta->key_size != key_size || memcmp(meta->key, key, key_size) != 0) continue;
+        if (size != NULL) *size = meta->value_size;
+        return meta->value;
+    }
+    return NULL;
+}
+
+const Htmd_Stats* htmd_stats(Htmd_Context *ctx)
+{
+    Htmd_Stats *stats = &ctx->stats;
+    stats->output_bytes = ctx->flushed_bytes + ctx->out.count + ctx->rope_bytes;
+    if (ctx->out.count > stats->peak_output_size) stats->peak_output_size = ctx->out.count;
+    stats->block_nanos = ctx->parse_nanos - stats->inline_nanos;
+    return stats;
+}
+
+EMSCRIPTEN_KEEPALIVE char* render_markdown(char *input)
+{
+    Htmd_Context ctx;
+    htmd_init(&ctx, NULL);
+    // the result is released by the caller with free(), so it can't live in an arena
+    ctx.scratch = libc_allocator;
+
+    render_document(&ctx, input, strlen(input));
+    out_append(&ctx, "", 1);
+    // the front matter isn't returned, only the HTML
+    if (ctx.meta.items != NULL) ctx.scratch.free(ctx.scratch.user, ctx.meta.items, ctx.meta.capacity*sizeof(Htmd_Meta));
+    if (ctx.stats.out_of_memory){
+        free(ctx.out.items);
+        return NULL;
+    }
+    return ctx.out.items;
+}
+
+// Rendering into a fixed buffer uses a context on the stack and parses the
+// input in place, so nothing is allocated at all.
+
+size_t htmd_measure(const char *input, size_t len)
+{
+    Htmd_Context ctx;
+    htmd_init(&ctx, NULL);
+    ctx.output_mode = Output_Fixed;
+    render_document(&ctx, input, len);
+    return ctx.out.count;
+}
+
+// a single pass: what doesn't fit is only counted
+size_t htmd_render_into(const char *input, size_t len, char *out, size_t out_cap)
+{
+    Htmd_Context ctx;
+    htmd_init(&ctx, NULL);
+    ctx.output_mode = Output_Fixed;
+    ctx.out = (Buffer) {.items = out, .capacity = out_cap};
+    render_document(&ctx, input, len);
+    return ctx.out.count;
 }
@@ -0,0 +1,368 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include <htmd.h>
+#include "search.h"
+#include "site.h"
+
+#define NOB_STRIP_PREFIX
+#include <nob.h>
+#include "escape.h"
+
+#define SEARCH_WORD_MAX 64   // bytes
+#define SEARCH_MIN_SLOTS 1024
+
+// Dictionary of words: open addressing over their ids, kept at most half full.
+typedef struct{
+    size_t offset;        // in `chars`, NUL-terminated
+    size_t size;
+    uint64_t hash;
+    uint32_t page;        // builders: the page it was last seen in, plus one
+    uint32_t count;       // builders: of it in that page; the index: of its postings
+} Word;
+
+typedef struct{
+    Word *items;
+    size_t count;
+    size_t capacity;
+    String_Builder chars;
+    uint32_t *slots;      // ids plus one, 0: empty
+    size_t mask;
+} Words;
+
+typedef struct{
+    size_t path;          // offset in `paths`
+    size_t postings;      // offset in `postings`
+    size_t postings_size;
+} Page;
+
+struct Search_Builder{
+    Words words;
+    struct{
+        Page *items;
+        size_t count;
+        size_t capacity;
+    } pages;
+    String_Builder paths;
+    String_Builder postings;
+    struct{
+        uint32_t *items;
+        size_t count;
+        size_t capacity;
+    } current;            // ids of the words of the current page
+    char word[SEARCH_WORD_MAX];
+    size_t word_size;     // of the word cut by the end of a run; longer words (URLs, hashes) are left out
+};
+
+struct Search_Index{
+    Search_Builder **items;
+    size_t count;
+    size_t capacity;
+};
+
+void words_grow(Words *words)
+{
+    size_t capacity = words->slots == NULL ? SEARCH_MIN_SLOTS : 2*(words->mask + 1);
+    uint32_t *slots = calloc(capacity, sizeof(*slots));
+    assert(slots != NULL && "Buy more RAM");
+    for (size_t id = 0; id < words->count; ++id){
+        size_t i = words->items[id].hash & (capacity - 1);
+        while (slots[i] != 0) i = (i + 1) & (capacity - 1);
+        slots[i] = id + 1;
+    }
+    free(words->slots);
+    words->slots = slots;
+    words->mask = capacity - 1;
+}
+
+uint32_t words_intern(Words *words, const char *text, size_t size)
+{
+    if (words->slots == NULL || 2*(words->count + 1) > words->mask + 1) words_grow(words);
+    uint64_t hash = htmd_hash(text, size).lo;
+    size_t i = hash & words->mask;
+    while (words->slots[i] != 0){
+        Word *word = &words->items[words->slots[i] - 1];
+        if (word->hash == hash && word->size == size && memcmp(words->chars.items + word->offset, text, size) == 0){
+            return words->slots[i] - 1;
+        }
+        i = (i + 1) & words->mask;
+    }
+    Word word = {.offset = words->chars.count, .size = size, .hash = hash};
+    sb_append_buf(&words->chars, text, size);
+    sb_append_null(&words->chars);
+    da_append(words, word);
+    words->slots[i] = words->count;
+    return words->count - 1;
+}
+
+void words_free(Words *words)
+{
+    da_free(*words);
+    sb_free(words->chars);
+    free(words->slots);
+}
+
+void varint_put(String_Builder *sb, uint64_t value)
+{
+    do{
+        char byte = value & 0x7F;
+        value >>= 7;
+        if (value != 0) byte |= 0x80;
+        da_append(sb, byte);
+    }while (value != 0);
+}
+
+uint64_t varint_get(const unsigned char **pr)
+{
+    uint64_t value = 0;
+    for (unsigned shift = 0;; shift += 7){
+        unsigned char byte = *(*pr)++;
+        value |= (uint64_t) (byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) return value;
+    }
+}
+
+// Building
+
+Search_Builder* search_builder_create(void)
+{
+    Search_Builder *builder = calloc(1, sizeof(*builder));
+    assert(builder != NULL && "Buy more RAM");
+    return builder;
+}
+
+void search_builder_destroy(Search_Builder *builder)
+{
+    if (builder == NULL) return;
+    words_free(&builder->words);
+    da_free(builder->pages);
+    sb_free(builder->paths);
+    sb_free(builder->postings);
+    da_free(builder->current);
+    free(builder);
+}
+
+void search_begin(Search_Builder *builder, const char *path)
+{
+    Page page = {.path = builder->paths.count};
+    sb_append_cstr(&builder->paths, path);
+    sb_append_null(&builder->paths);
+    da_append(&builder->pages, page);
+    builder->current.count = 0;
+    builder->word_size = 0;
+}
+
+void add_word(Search_Builder *builder)
+{
+    size_t size = builder->word_size;
+    builder->word_size = 0;
+    // single letters and digits aren't worth looking up
+    if (size < 2 || size > SEARCH_WORD_MAX) return;
+    uint32_t id = words_intern(&builder->words, builder->word, size);
+    Word *word = &builder->words.items[id];
+    uint32_t page = builder->pages.count;
+    if (word->page != page){
+        word->page = page;
+        word->count = 0;
+        da_append(&builder->current, id);
+    }
+    word->count += 1;
+}
+
+void search_text(Search_Builder *builder, const char *text, size_t size)
+{
+    for (size_t i = 0; i < size; ++i){
+        unsigned char c = text[i];
+        bool letter = (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80;
+        if (c >= 'A' && c <= 'Z'){
+            c = c - 'A' + 'a';
+            letter = true;
+        }
+        if (!letter){
+            if (builder->word_size > 0) add_word(builder);
+            continue;
+        }
+        // too long: counted on, but not kept
+        if (builder->word_size < SEARCH_WORD_MAX) builder->word[builder->word_size] = c;
+        builder->word_size += 1;
+    }
+}
+
+int compare_ids(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+// the postings of a page: the number of its words, then per word the
+// difference of its id to the one before and its count
+void search_end(Search_Builder *builder)
+{
+    if (builder->word_size > 0) add_word(builder);
+    Page *page = &builder->pages.items[builder->pages.count-1];
+    qsort(builder->current.items, builder->current.count, sizeof(uint32_t), compare_ids);
+    page->postings = builder->postings.count;
+    varint_put(&builder->postings, builder->current.count);
+    uint32_t last = 0;
+    for (size_t i = 0; i < builder->current.count; ++i){
+        uint32_t id = builder->current.items[i];
+        varint_put(&builder->postings, id - last);
+        varint_put(&builder->postings, builder->words.items[id].count);
+        last = id;
+    }
+    page->postings_size = builder->postings.count - page->postings;
+}
+
+// Merging
+
+Search_Index* search_index_create(void)
+{
+    Search_Index *index = calloc(1, sizeof(*index));
+    assert(index != NULL && "Buy more RAM");
+    return index;
+}
+
+void search_index_destroy(Search_Index *index)
+{
+    if (index == NULL) return;
+    for (size_t i = 0; i < index->count; ++i) search_builder_destroy(index->items[i]);
+    da_free(*index);
+    free(index);
+}
+
+void search_index_merge(Search_Index *index, Search_Builder *builder)
+{
+    da_append(index, builder);
+}
+
+typedef struct{
+    size_t builder;       // in the index
+    const Page *page;
+    const char *path;     // relative to the root
+} Indexed_Page;
+
+int compare_indexed_pages(const void *a, const void *b)
+{
+    return strcmp(((const Indexed_Page*) a)->path, ((const Indexed_Page*) b)->path);
+}
+
+typedef struct{
+    const char *text;
+    uint32_t id;
+} Sorted_Word;
+
+int compare_sorted_words(const void *a, const void *b)
+{
+    return strcmp(((const Sorted_Word*) a)->text, ((const Sorted_Word*) b)->text);
+}
+
+char* search_json(const Search_Index *index, const char *root, size_t *size)
+{
+    // the pages of all threads, in the order of their paths
+    struct{
+        Indexed_Page *items;
+        size_t count;
+        size_t capacity;
+    } pages = {0};
+    for (size_t b = 0; b < index->count; ++b){
+        const Search_Builder *builder = index->items[b];
+        for (size_t j = 0; j < builder->pages.count; ++j){
+            const Page *page = &builder->pages.items[j];
+            da_append(&pages, ((Indexed_Page) {
+                .builder = b,
+                .page = page,
+                .path = site_relative_path(root, builder->paths.items + page->path),
+            }));
+        }
+    }
+    qsort(pages.items, pages.count, sizeof(*pages.items), compare_indexed_pages);
+
+    // one dictionary, with the ids of every builder mapped into it
+    Words words = {0};
+    uint32_t **ids = calloc(index->count > 0 ? index->count : 1, sizeof(*ids));
+    assert(ids != NULL && "Buy more RAM");
+    for (size_t b = 0; b < index->count; ++b){
+        const Words *local = &index->items[b]->words;
+        ids[b] = malloc((local->count > 0 ? local->count : 1)*sizeof(**ids));
+        assert(ids[b] != NULL && "Buy more RAM");
+        for (size_t id = 0; id < local->count; ++id){
+            const Word *word = &local->items[id];
+            ids[b][id] = words_intern(&words, local->chars.items + word->offset, word->size);
+        }
+    }
+
+    // Turned around in two passes over the postings of the pages: the first
+    // counts the pages of every word, the second puts them into one array at
+    // the offsets that follow from the counts. Going through the pages in
+    // order leaves the pages of every word sorted.
+    size_t *starts = calloc(words.count + 1, sizeof(*starts));
+    assert(starts != NULL && "Buy more RAM");
+    uint32_t *postings = NULL;
+    for (int pass = 0; pass < 2; ++pass){
+        for (size_t p = 0; p < pages.count; ++p){
+            const Search_Builder *builder = index->items[pages.items[p].builder];
+            const uint32_t *map = ids[pages.items[p].builder];
+            const unsigned char *pr = (const unsigned char*) builder->postings.items + pages.items[p].page->postings;
+            uint64_t n = varint_get(&pr);
+            uint32_t id = 0;
+            for (uint64_t k = 0; k < n; ++k){
+                id += varint_get(&pr);
+                uint32_t count = varint_get(&pr);
+                uint32_t word = map[id];
+                if (pass == 0){
+                    starts[word + 1] += 1;
+                }else{
+                    size_t at = starts[word] + 2*words.items[word].count++;
+                    postings[at] = p;
+                    postings[at + 1] = count;
+                }
+            }
+        }
+        if (pass == 0){
+            for (size_t w = 0; w < words.count; ++w) starts[w + 1] = starts[w] + 2*starts[w + 1];
+            postings = malloc((starts[words.count] > 0 ? starts[words.count] : 1)*sizeof(*postings));
+            assert(postings != NULL && "Buy more RAM");
+        }
+    }
+
+    Sorted_Word *sorted = malloc((words.count > 0 ? words.count : 1)*sizeof(*sorted));
+    assert(sorted != NULL && "Buy more RAM");
+    for (size_t w = 0; w < words.count; ++w){
+        sorted[w] = (Sorted_Word) {.text = words.chars.items + words.items[w].offset, .id = w};
+    }
+    qsort(sorted, words.count, sizeof(*sorted), compare_sorted_words);
+
+    String_Builder sb = {0};
+    sb_append_cstr(&sb, "{\"pages\": [");
+    for (size_t p = 0; p < pages.count; ++p){
+        if (p > 0) sb_append_cstr(&sb, ", ");
+        sb_append_json(&sb, pages.items[p].path, strlen(pages.items[p].path));
+    }
+    sb_append_cstr(&sb, "],\n\"words\": {");
+    for (size_t w = 0; w < words.count; ++w){
+        sb_append_cstr(&sb, w > 0 ? ",\n" : "\n");
+        sb_append_json(&sb, sorted[w].text, strlen(sorted[w].text));
+        sb_append_cstr(&sb, ": [");
+        uint32_t id = sorted[w].id;
+        uint32_t last = 0;
+        for (size_t at = starts[id]; at < starts[id + 1]; at += 2){
+            sb_appendf(&sb, at > starts[id] ? ",%u,%u" : "%u,%u", postings[at] - last, postings[at + 1]);
+            last = postings[at];
+        }
+        sb_append_cstr(&sb, "]");
+    }
+    sb_append_cstr(&sb, "\n}}\n");
+
+    for (size_t b = 0; b < index->count; ++b) free(ids[b]);
+    free(ids);
+    free(starts);
+    free(postings);
+    free(sorted);
+    words_free(&words);
+    da_free(pages);
+    *size = sb.count;
+    return sb.items;
+}
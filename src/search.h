@@ -0,0 +1,38 @@
+#ifndef _SEARCH_H
+#define _SEARCH_H
+
+#include <stddef.h>
+
+// Inverted index of the words of a site's pages, for client-side search.
+//
+// Every render thread tokenizes the text of its pages while they are
+// rendered (Htmd_Options.text) into its own Search_Builder: a dictionary of
+// the words it has seen and, per page, the ids of its words with their
+// counts, sorted and delta-encoded as varints. search_json() merges the
+// dictionaries and turns those postings around into one list of pages per
+// word. Words are runs of letters and digits, ASCII lowercased; bytes above
+// 0x7F count as letters, so UTF-8 words stay whole.
+
+typedef struct Search_Builder Search_Builder;
+typedef struct Search_Index Search_Index;
+
+Search_Builder* search_builder_create(void);
+void search_builder_destroy(Search_Builder *builder);
+void search_begin(Search_Builder *builder, const char *path);
+// takes a run of text as an Htmd_Text_Fn gets it
+void search_text(Search_Builder *builder, const char *text, size_t size);
+void search_end(Search_Builder *builder);
+
+// of the pages of all render threads
+Search_Index* search_index_create(void);
+void search_index_destroy(Search_Index *index);
+// takes `builder` over
+void search_index_merge(Search_Index *index, Search_Builder *builder);
+// Returns the index as malloc()ed JSON, with the pages sorted by path and
+// their paths relative to `root`:
+//   {"pages": ["index.html", ...], "words": {"word": [page, count, ...], ...}}
+// The pages of a word are ascending, each given as the difference to the one
+// before.
+char* search_json(const Search_Index *index, const char *root, size_t *size);
+
+#endif // _SEARCH_H
@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <sys/uio.h>
+
+#include <cwalk.h>
+#include "site.h"
+#include "output.h"
+
+#define NOB_STRIP_PREFIX
+#include <nob.h>
+#include "escape.h"
+
+#define FEED_ENTRIES 20
+#define FEED_SUMMARY_SIZE 300
+
+typedef struct{
+    const char *path;     // relative to the output directory
+    const char *title;
+    const char *text;
+    size_t text_size;
+    int64_t mtime;
+} Site_Page;
+
+const char* site_relative_path(const char *root, const char *path)
+{
+    size_t root_len = strlen(root);
+    if (strcmp(root, ".") == 0) return path;
+    if (strncmp(path, root, root_len) == 0 && path[root_len] == '/') return path + root_len + 1;
+    return path;
+}
+
+bool site_wanted(const Site_Options *options)
+{
+    return options != NULL && (options->url != NULL || options->search_index);
+}
+
+int compare_pages_by_path(const void *a, const void *b)
+{
+    return strcmp(((const Site_Page*) a)->path, ((const Site_Page*) b)->path);
+}
+
+int compare_pages_by_mtime(const void *a, const void *b)
+{
+    const Site_Page *x = a, *y = b;
+    if (x->mtime != y->mtime) return x->mtime > y->mtime ? -1 : 1;
+    return strcmp(x->path, y->path);
+}
+
+// `url` followed by the percent-encoded `path`, escaped for XML
+void sb_append_page_url(String_Builder *sb, const char *url, const char *path)
+{
+    size_t url_len = strlen(url);
+    sb_append_xml(sb, url, url_len);
+    if (url_len > 0 && url[url_len-1] != '/' && path[0] != '\0') sb_append_cstr(sb, "/");
+    for (const unsigned char *pr = (const unsigned char*) path; *pr != '\0'; ++pr){
+        bool plain = (*pr >= 'a' && *pr <= 'z') || (*pr >= 'A' && *pr <= 'Z') || (*pr >= '0' && *pr <= '9') || strchr("-._~/", *pr) != NULL;
+        if (plain) da_append(sb, (char) *pr);
+        else sb_appendf(sb, "%%%02X", *pr);
+    }
+}
+
+void sb_append_time(String_Builder *sb, int64_t mtime)
+{
+    char buffer[32];
+    time_t t = (time_t) mtime;
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    size_t n = strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%SZ", &tm);
+    sb_append_buf(sb, buffer, n);
+}
+
+// the start of the text, cut after a word
+size_t summary_size(const char *text, size_t size)
+{
+    if (size <= FEED_SUMMARY_SIZE) return size;
+    size_t n = FEED_SUMMARY_SIZE;
+    while (n > 0 && text[n] != ' ') n -= 1;
+    if (n == 0){
+        n = FEED_SUMMARY_SIZE;
+        while (n > 0 && (text[n] & 0xC0) == 0x80) n -= 1;
+    }
+    return n;
+}
+
+bool site_write_file(const char *out_dir, const char *name, const char *data, size_t size, bool if_changed)
+{
+    char path[FILENAME_MAX];
+    cwk_path_join(out_dir, name, path, sizeof(path));
+    if (!if_changed) return write_entire_file(path, data, size);
+    struct iovec iov = {(void*) data, size};
+    return write_if_changed(path, &iov, 1, 0644, NULL) != Write_Failed;
+}
+
+void append_sitemap(String_Builder *sb, const Site_Page *pages, size_t count, const char *url)
+{
+    sb_append_cstr(sb, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    sb_append_cstr(sb, "<urlset xmlns=\"http://www.sitemaps.org/schemas/sitemap/0.9\">\n");
+    for (size_t i = 0; i < count; ++i){
+        sb_append_cstr(sb, "  <url><loc>");
+        sb_append_page_url(sb, url, pages[i].path);
+        sb_append_cstr(sb, "</loc><lastmod>");
+        sb_append_time(sb, pages[i].mtime);
+        sb_append_cstr(sb, "</lastmod></url>\n");
+    }
+    sb_append_cstr(sb, "</urlset>\n");
+}
+
+// `pages` sorted by path, the feed title is that of the index page
+void append_feed(String_Builder *sb, const Site_Page *pages, size_t count, const char *url)
+{
+    const char *title = url;
+    Site_Page *recent = malloc((count > 0 ? count : 1)*sizeof(*recent));
+    assert(recent != NULL && "Buy more RAM");
+    for (size_t i = 0; i < count; ++i){
+        if (strcmp(pages[i].path, "index.html") == 0 && pages[i].title[0] != '\0') title = pages[i].title;
+        recent[i] = pages[i];
+    }
+    qsort(recent, count, sizeof(*recent), compare_pages_by_mtime);
+    if (count > FEED_ENTRIES) count = FEED_ENTRIES;
+
+    sb_append_cstr(sb, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n");
+    sb_append_cstr(sb, "<feed xmlns=\"http://www.w3.org/2005/Atom\">\n");
+    sb_append_cstr(sb, "  <title>");
+    sb_append_xml(sb, title, strlen(title));
+    sb_append_cstr(sb, "</title>\n  <id>");
+    sb_append_page_url(sb, url, "");
+    sb_append_cstr(sb, "</id>\n  <link href=\"");
+    sb_append_page_url(sb, url, "");
+    sb_append_cstr(sb, "\"/>\n  <link rel=\"self\" href=\"");
+    sb_append_page_url(sb, url, "feed.xml");
+    sb_append_cstr(sb, "\"/>\n  <updated>");
+    sb_append_time(sb, count > 0 ? recent[0].mtime : 0);
+    sb_append_cstr(sb, "</updated>\n");
+    for (size_t i = 0; i < count; ++i){
+        const Site_Page *page = &recent[i];
+        sb_append_cstr(sb, "  <entry>\n    <title>");
+        sb_append_xml(sb, page->title, strlen(page->title));
+        sb_append_cstr(sb, "</title>\n    <id>");
+        sb_append_page_url(sb, url, page->path);
+        sb_append_cstr(sb, "</id>\n    <link href=\"");
+        sb_append_page_url(sb, url, page->path);
+        sb_append_cstr(sb, "\"/>\n    <updated>");
+        sb_append_time(sb, page->mtime);
+        sb_append_cstr(sb, "</updated>\n    <summary>");
+        sb_append_xml(sb, page->text, summary_size(page->text, page->text_size));
+        sb_append_cstr(sb, "</summary>\n  </entry>\n");
+    }
+    sb_append_cstr(sb, "</feed>\n");
+    free(recent);
+}
+
+void append_search_index(String_Builder *sb, const Site_Page *pages, size_t count)
+{
+    sb_append_cstr(sb, "[\n");
+    for (size_t i = 0; i < count; ++i){
+        const Site_Page *page = &pages[i];
+        sb_append_cstr(sb, "{\"url\": ");
+        sb_append_json(sb, page->path, strlen(page->path));
+        sb_append_cstr(sb, ", \"title\": ");
+        sb_append_json(sb, page->title, strlen(page->title));
+        sb_append_cstr(sb, ", \"text\": ");
+        sb_append_json(sb, page->text, page->text_size);
+        sb_append_cstr(sb, i + 1 < count ? "},\n" : "}\n");
+    }
+    sb_append_cstr(sb, "]\n");
+}
+
+bool site_write(const char *out_dir, const Batch_Pages *batch_pages, const Search_Index *search, const Site_Options *options)
+{
+    if (!site_wanted(options)) return true;
+    char root[FILENAME_MAX];
+    cwk_path_normalize(out_dir, root, sizeof(root));
+    // the titles of pages without a heading are their file names
+    String_Builder names = {0};
+    size_t *name_offsets = malloc((batch_pages->count > 0 ? batch_pages->count : 1)*sizeof(*name_offsets));
+    Site_Page *pages = malloc((batch_pages->count > 0 ? batch_pages->count : 1)*sizeof(*pages));
+    assert(pages != NULL && name_offsets != NULL && "Buy more RAM");
+    for (size_t i = 0; i < batch_pages->count; ++i){
+        const Batch_Page *page = &batch_pages->items[i];
+        const char *strings = batch_pages->strings.items;
+        const char *path = site_relative_path(root, strings + page->output);
+        pages[i] = (Site_Page) {
+            .path = path,
+            .title = strings + page->title,
+            .text = strings + page->text,
+            .text_size = page->text_size,
+            .mtime = page->mtime,
+        };
+        name_offsets[i] = SIZE_MAX;
+        if (pages[i].title[0] == '\0'){
+            const char *base;
+            size_t base_len;
+            cwk_path_get_basename(path, &base, &base_len);
+            if (base_len > 5 && strcmp(base + base_len - 5, ".html") == 0) base_len -= 5;
+            name_offsets[i] = names.count;
+            sb_append_buf(&names, base, base_len);
+            sb_append_null(&names);
+        }
+    }
+    for (size_t i = 0; i < batch_pages->count; ++i){
+        if (name_offsets[i] != SIZE_MAX) pages[i].title = names.items + name_offsets[i];
+    }
+    // sorted, so that an unchanged site makes the same files
+    qsort(pages, batch_pages->count, sizeof(*pages), compare_pages_by_path);
+
+    bool ok = true;
+    String_Builder sb = {0};
+    if (options->url != NULL){
+        append_sitemap(&sb, pages, batch_pages->count, options->url);
+        ok = site_write_file(root, "sitemap.xml", sb.items, sb.count, options->if_changed) && ok;
+        sb.count = 0;
+        append_feed(&sb, pages, batch_pages->count, options->url);
+        ok = site_write_file(root, "feed.xml", sb.items, sb.count, options->if_changed) && ok;
+        sb.count = 0;
+    }
+    if (options->search_index){
+        append_search_index(&sb, pages, batch_pages->count);
+        ok = site_write_file(root, "search.json", sb.items, sb.count, options->if_changed) && ok;
+        size_t size;
+        char *json = search_json(search, root, &size);
+        ok = site_write_file(root, "search-index.json", json, size, options->if_changed) && ok;
+        free(json);
+    }
+    sb_free(sb);
+    sb_free(names);
+    free(name_offsets);
+    free(pages);
+    return ok;
+}
@@ -0,0 +1,29 @@
+#ifndef _SITE_H
+#define _SITE_H
+
+#include <stdbool.h>
+
+#include "batch.h"
+#include "search.h"
+
+// Files describing a built site, made from what the render threads collected
+// about its pages (Batch_Pages, Search_Index) instead of reading the output
+// again: sitemap.xml and an Atom feed (feed.xml) of the most recently changed
+// pages, which need the URL the site is served from, search.json with the
+// title and text of every page and search-index.json, its inverted index.
+
+typedef struct{
+    const char *url;      // of the output directory, e.g. "https://example.com/docs/"; NULL: no sitemap and feed
+    bool search_index;    // search.json and search-index.json
+    bool if_changed;      // see write_if_changed()
+} Site_Options;
+
+// whether any file is to be written at all
+bool site_wanted(const Site_Options *options);
+// Writes the files into `out_dir`, under which the outputs of `pages` are.
+// `search` is needed with search_index.
+bool site_write(const char *out_dir, const Batch_Pages *pages, const Search_Index *search, const Site_Options *options);
+// `path` relative to the normalized directory `root` it is in
+const char* site_relative_path(const char *root, const char *path);
+
+#endif // _SITE_H
@@ -0,0 +1,116 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "template.h"
+
+#define NOB_STRIP_PREFIX
+#include <nob.h>
+#include "escape.h"
+
+void template_push(Template *template, Template_Slot slot, const char *data, size_t size)
+{
+    if (slot == Template_Literal && size == 0) return;
+    da_append(template, ((Template_Segment) {.slot = slot, .data = data, .size = size}));
+    template->has[slot] = true;
+}
+
+// the slot named between the braces of a placeholder
+bool template_slot(const char *name, size_t size, Template_Slot *slot)
+{
+    static const char *slot_names[_Template_Slot_Count] = {
+        [Template_Title] = "title",
+        [Template_Content] = "content",
+        [Template_Toc] = "toc",
+    };
+    while (size > 0 && *name == ' ') name += 1, size -= 1;
+    while (size > 0 && name[size-1] == ' ') size -= 1;
+    for (size_t i = 0; i < _Template_Slot_Count; ++i){
+        if (slot_names[i] != NULL && strlen(slot_names[i]) == size && memcmp(slot_names[i], name, size) == 0){
+            *slot = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool template_load(Template *template, const char *path)
+{
+    *template = (Template) {0};
+    String_Builder sb = {0};
+    if (!read_entire_file(path, &sb)) return false;
+    template->source = sb.items;
+    template->size = sb.count;
+    const char *pr = sb.items;
+    const char *end = sb.items + sb.count;
+    const char *last = pr;
+    size_t line = 1;
+    while (pr < end){
+        const char *open = memmem(pr, end - pr, "{{", 2);
+        if (open == NULL) break;
+        for (const char *counted = pr; counted < open; ++counted) line += *counted == '\n';
+        const char *close = memmem(open + 2, end - open - 2, "}}", 2);
+        const char *newline = memchr(open, '\n', end - open);
+        // braces that aren't closed on their line are text
+        if (close == NULL || (newline != NULL && newline < close)){
+            pr = open + 2;
+            continue;
+        }
+        Template_Slot slot;
+        if (!template_slot(open + 2, close - open - 2, &slot)){
+            fprintf(stderr, "[ERROR] %s:%zu: unknown placeholder '%.*s'\n", path, line, (int) (close + 2 - open), open);
+            template_free(template);
+            return false;
+        }
+        template_push(template, Template_Literal, last, open - last);
+        template_push(template, slot, NULL, 0);
+        pr = last = close + 2;
+    }
+    template_push(template, Template_Literal, last, end - last);
+    if (!template->has[Template_Content]){
+        fprintf(stderr, "[ERROR] %s: the template has no {{content}}\n", path);
+        template_free(template);
+        return false;
+    }
+    return true;
+}
+
+void template_free(Template *template)
+{
+    free(template->source);
+    free(template->items);
+    *template = (Template) {0};
+}
+
+size_t template_fill(const Template *template, const Template_Values *values, struct iovec *iov)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < template->count; ++i){
+        const Template_Segment *segment = &template->items[i];
+        switch (segment->slot){
+            case Template_Literal: iov[i] = (struct iovec) {(void*) segment->data, segment->size}; break;
+            case Template_Title: iov[i] = (struct iovec) {(void*) values->title, values->title_size}; break;
+            case Template_Content: iov[i] = (struct iovec) {(void*) values->content, values->content_size}; break;
+            case Template_Toc: iov[i] = (struct iovec) {(void*) values->toc, values->toc_size}; break;
+            case _Template_Slot_Count: assert(false && "unreachable");
+        }
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+size_t template_escape(const char *text, size_t size, char *buffer, size_t capacity)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < size; ++i){
+        const char *entity = xml_entity(text[i]);
+        size_t entity_size = entity != NULL ? strlen(entity) : 1;
+        if (n + entity_size > capacity) break;
+        if (entity != NULL) memcpy(buffer + n, entity, entity_size);
+        else buffer[n] = text[i];
+        n += entity_size;
+    }
+    return n;
+}
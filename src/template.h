@@ -0,0 +1,57 @@
+#ifndef _TEMPLATE_H
+#define _TEMPLATE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+// Page templates for -f: HTML with {{title}}, {{content}} and {{toc}} in it.
+// A template is parsed once into segments, literal runs of the file and
+// slots, and every page fills it by pointing an iovec at each, so neither
+// the template nor the rendered HTML is copied to make a page.
+
+typedef enum{
+    Template_Literal,
+    Template_Title,     // the title of the page, escaped
+    Template_Content,   // the rendered document
+    Template_Toc,       // its table of contents, see Htmd_Options.toc_apart
+    _Template_Slot_Count,
+} Template_Slot;
+
+typedef struct{
+    Template_Slot slot;
+    const char *data;   // of literals, into `source`
+    size_t size;
+} Template_Segment;
+
+typedef struct{
+    char *source;
+    size_t size;        // of source
+    Template_Segment *items;
+    size_t count;
+    size_t capacity;
+    bool has[_Template_Slot_Count];
+} Template;
+
+typedef struct{
+    const char *title;
+    size_t title_size;
+    const char *content;
+    size_t content_size;
+    const char *toc;
+    size_t toc_size;
+} Template_Values;
+
+// Reads and parses the template at `path`. Placeholders may have spaces
+// inside the braces; unknown ones and a template without {{content}} are
+// errors.
+bool template_load(Template *template, const char *path);
+void template_free(Template *template);
+// Points `iov`, which has room for template->count entries, at the pieces
+// of a page and returns its size.
+size_t template_fill(const Template *template, const Template_Values *values, struct iovec *iov);
+// Escapes `text` for HTML into `buffer`, as much of it as fits, and returns
+// the size written.
+size_t template_escape(const char *text, size_t size, char *buffer, size_t capacity);
+
+#endif // _TEMPLATE_H
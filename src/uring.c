@@ -0,0 +1,109 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+bool uring_init(Uring *ring, unsigned entries)
+{
+    *ring = (Uring) {.fd = -1};
+    struct io_uring_params params = {0};
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    ring->syscalls += 1;
+    if (ring->fd < 0) return false;
+    // the single mmap layout (5.4) is the oldest one supported
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) goto fail;
+
+    // both rings share one mapping
+    size_t sq_size = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->sq_ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED){
+        ring->sq_ring = NULL;
+        goto fail;
+    }
+    ring->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED){
+        ring->sqes = NULL;
+        goto fail;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned*) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+    char *cq = ring->sq_ring;
+    ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+    return true;
+
+  fail:
+    uring_free(ring);
+    return false;
+}
+
+void uring_free(Uring *ring)
+{
+    if (ring->sqes != NULL) munmap(ring->sqes, ring->sqes_size);
+    if (ring->sq_ring != NULL) munmap(ring->sq_ring, ring->ring_size);
+    if (ring->fd >= 0) close(ring->fd);
+    size_t syscalls = ring->syscalls;
+    *ring = (Uring) {.fd = -1, .syscalls = syscalls};
+}
+
+int uring_register(Uring *ring, unsigned opcode, const void *arg, unsigned count)
+{
+    ring->syscalls += 1;
+    return syscall(__NR_io_uring_register, ring->fd, opcode, arg, count);
+}
+
+struct io_uring_sqe* uring_get_sqe(Uring *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail + ring->sq_queued;
+    if (tail - head > ring->sq_mask) return NULL;
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_queued += 1;
+    return sqe;
+}
+
+unsigned uring_sq_space(Uring *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    return ring->sq_mask + 1 - (*ring->sq_tail + ring->sq_queued - head);
+}
+
+int uring_submit(Uring *ring, unsigned wait_count)
+{
+    unsigned submit = ring->sq_queued;
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + submit, __ATOMIC_RELEASE);
+    ring->sq_queued = 0;
+    for (;;){
+        ring->syscalls += 1;
+        int n = syscall(__NR_io_uring_enter, ring->fd, submit, wait_count, wait_count > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n >= 0 || errno != EINTR) return n;
+        submit = 0;
+    }
+}
+
+struct io_uring_cqe* uring_peek_cqe(Uring *ring)
+{
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(Uring *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,39 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring bindings on top of the raw system calls, so liburing isn't
+// needed. Not thread-safe: one thread at a time may use a ring.
+typedef struct{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_queued;        // prepared but not yet submitted
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;             // the completion ring shares this mapping
+    size_t ring_size;
+    size_t sqes_size;
+    size_t syscalls;           // io_uring_enter and register calls made
+} Uring;
+
+bool uring_init(Uring *ring, unsigned entries);
+void uring_free(Uring *ring);
+int uring_register(Uring *ring, unsigned opcode, const void *arg, unsigned count);
+// a zeroed submission entry, or NULL when the queue is full
+struct io_uring_sqe* uring_get_sqe(Uring *ring);
+unsigned uring_sq_space(Uring *ring);
+// submits the queued entries and waits until `wait_count` completions are there
+int uring_submit(Uring *ring, unsigned wait_count);
+struct io_uring_cqe* uring_peek_cqe(Uring *ring);
+void uring_cqe_seen(Uring *ring);
+
+#endif // _URING_H